@@ -248,7 +248,7 @@ static void Invert_same_ref( char *source, struct CodecControlBlock *ccb )
 	register unsigned long *p = (unsigned long *)ccb->baseAddr;
 	register int input_width_long = (ccb->source_width32)+1;
 
-	register int y = ccb->source_height;
+	register int y = ccb->source_height+1;
 	while (--y)
 	{
 		register int x = input_width_long;
@@ -323,6 +323,534 @@ static void CopyLines_all_ref( char *source, struct CodecControlBlock *ccb )
 
 
 
+//	-------------------------------------------------------------------
+//	Codec 0x05 : scroll (reference implementation)
+//	Moves a band of lines vertically (and horizontally by whole bytes),
+//	then fixes the rest of the screen like z32
+//	On-disk data:
+//		2 bytes     : first line of the band
+//		2 bytes     : number of lines of the band (0 for no move)
+//		2 bytes     : vertical move in lines (signed, positive is down)
+//		2 bytes     : horizontal move in bytes (signed, positive is right)
+//		z32 data    : residual
+//	The bytes uncovered by the horizontal move are left untouched
+//	-------------------------------------------------------------------
+
+static void ScrollLines( char *source, struct CodecControlBlock *ccb, Boolean same )
+{
+	short from = ((short*)source)[0];
+	short count = ((short*)source)[1];
+	short dy = ((short*)source)[2];
+	short dx = ((short*)source)[3];
+	short len = ccb->source_width8-(dx<0?-dx:dx);
+	short src_skip = dx<0?-dx:0;
+	short dst_skip = dx>0?dx:0;
+	short i;
+
+	for (i=0;i!=count;i++)
+	{
+		unsigned char *src;
+		unsigned char *dst;
+			//	When moving down, start from the bottom, so no line is overwritten before being moved
+		short y = dy>0?from+count-1-i:from+i;
+
+		if (same)
+		{
+			src = ccb->baseAddr+(y-dy)*(long)ccb->output_width8;
+			dst = ccb->baseAddr+y*(long)ccb->output_width8;
+		}
+		else
+		{
+			src = (unsigned char *)ccb->offsets32[(y-dy)*(long)ccb->source_width32];
+			dst = (unsigned char *)ccb->offsets32[y*(long)ccb->source_width32];
+		}
+
+		BlockMove( src+src_skip, dst+dst_skip, len );
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void Scroll_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	ScrollLines( source, ccb, TRUE );
+	UnpackZ32_same_ref( source+8, ccb );
+}
+
+static void Scroll_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	ScrollLines( source, ccb, FALSE );
+	UnpackZ32_all_ref( source+8, ccb );
+}
+
+static void Scroll_same( char *source, struct CodecControlBlock *ccb )
+{
+	ScrollLines( source, ccb, TRUE );
+	UnpackZ32_same( source+8, ccb );
+}
+
+static void Scroll_all( char *source, struct CodecControlBlock *ccb )
+{
+	ScrollLines( source, ccb, FALSE );
+	UnpackZ32_all( source+8, ccb );
+}
+
+//	-------------------------------------------------------------------
+//	Codec 0x06 : z32s
+//	  Same as z32, with 2 bytes headers
+//	Format:
+//	  A series of chunks
+//	  2 byte header : (0x0000 to end)
+//		1 byte      : offset in longs from the previous chunk
+//		1 byte      : count of data to copy (0 to skip more than 255 longs)
+//	  count quads   : data to be copied at vertical 32 pixels line
+//	-------------------------------------------------------------------
+
+static void UnpackZ32s_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned long *base = (unsigned long *)ccb->baseAddr;
+	register unsigned char *s = (unsigned char *)source;
+	register long rowlongs = ccb->output_width32;
+
+	while (s[0] || s[1])
+	{
+		register unsigned int copy;
+		register unsigned long *d;
+
+		base += s[0];
+		copy = s[1];
+		s += 2;
+
+		d = base;
+		while (copy--)
+		{
+			*d = *(unsigned long *)s;
+			s += 4;
+			d += rowlongs;
+		}
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void UnpackZ32s_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned long **offsets = (unsigned long **)ccb->offsets32;
+	register unsigned char *s = (unsigned char *)source;
+	register long rowlongs = ccb->output_width32;
+
+	while (s[0] || s[1])
+	{
+		register unsigned int copy;
+		register unsigned long *d;
+
+		offsets += s[0];
+		copy = s[1];
+		s += 2;
+
+		d = *offsets;
+		while (copy--)
+		{
+			*d = *(unsigned long *)s;
+			s += 4;
+			d += rowlongs;
+		}
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void UnpackZ32s_same( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned long *dest = (unsigned long *)ccb->baseAddr;
+	register unsigned short rowbytes = ccb->output_width8;
+
+	asm
+	{
+			;	Save registers
+		movem.l D5-D7/A2-A4,-(A7)
+
+			;	Get parameters
+		movea.l dest,a4				;	a4 == start of the current chunk
+		movea.l source,a3			;	a3 == source data
+		move    rowbytes,d5			;	d5 == rowbytes
+
+@loop:
+		move.w	(a3)+,d7			;	header
+		beq.s	@exit				;	0x0000 => end of frame
+
+		move.w	d7,d6
+		lsr.w	#6,d6
+		and.w	#0x3fc,d6			;	High byte of d7 is offset in longs
+		add.w	d6,a4
+
+		and.w	#0xff,d7			;	Low byte of d7 is count
+		beq.s	@loop				;	Skip only
+
+		movea.l	a4,a2
+		subq.w	#1,d7
+
+@loop2:
+        move.l	(a3)+,(a2)			;	Transfer data
+        add 	d5,a2				;	Add rowbytes
+		dbra.w	d7,@loop2
+
+        bra.s     @loop
+
+			;	Done
+@exit:
+        movem.l   (A7)+,D5-D7/A2-A4
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void UnpackZ32s_all( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned short rowbytes = ccb->output_width8;
+	register unsigned long *offsets = (unsigned long *)ccb->offsets32;
+
+	asm
+	{
+			;	Save registers
+		movem.l D5-D7/A1-A4,-(A7)
+
+			;	Get parameters
+		movea.l offsets,a4			;	a4 == entry of the current chunk in the offsets table
+		movea.l source,a3			;	a3 == source data
+		move.w 	rowbytes,d1			;	d1 == rowbytes
+
+@loop:
+		move.w	(a3)+,d7			;	header
+		beq.s	@exit				;	0x0000 => end of frame
+
+		move.w	d7,d6
+		lsr.w	#6,d6
+		and.w	#0x3fc,d6			;	High byte of d7 is offset in longs
+		add.w	d6,a4
+
+		and.w	#0xff,d7			;	Low byte of d7 is count
+		beq.s	@loop				;	Skip only
+
+		move.l	(a4),a2				;	offset for the output
+		subq.w	#1,d7
+
+@loop2:
+        move.l	(a3)+,(a2)			;	Transfer data
+        add 	d1,a2				;	Take stride into account
+		dbra.w	d7,@loop2
+
+        bra.s     @loop
+
+			;	Done
+@exit:
+        movem.l   (A7)+,D5-D7/A1-A4
+	}
+}
+
+//	-------------------------------------------------------------------
+//	Codec 0x07 : tiles (reference implementation)
+//	  Displays 32x8 tiles, either sent in full or taken from the
+//	  dictionary of the last tiles sent, then fixes the rest like z32
+//	Format:
+//	  A series of 2 bytes commands
+//		1 byte      : number of tiles to skip (tiles are numbered left to right, then top to bottom)
+//		1 byte      : slot of the tile in the dictionary
+//		              or 0xff : the 8 longs of the tile follow, it is added to the dictionary
+//		              or 0xfe : only skip (end of the commands if nothing is skipped)
+//	  z32 data      : residual
+//	When a tile that is about to be replaced in the dictionary is used,
+//	it is added again, so the tiles in use stay available
+//	-------------------------------------------------------------------
+
+static unsigned long *TileAdd( struct CodecControlBlock *ccb, unsigned long *tile )
+{
+	register unsigned long *d = ccb->tiles+ccb->tile_next*kTileLongs;
+	register short i;
+
+	if (d!=tile)
+		for (i=0;i!=kTileLongs;i++)
+			d[i] = tile[i];
+
+	if (++ccb->tile_next==kTileSlots)
+		ccb->tile_next = 0;
+
+	return d;
+}
+
+static char *DrawTiles( char *source, struct CodecControlBlock *ccb, Boolean same )
+{
+	register unsigned char *s = (unsigned char *)source;
+	register long rowlongs = ccb->output_width32;
+	short width32 = ccb->source_width32;
+	short tx = 0;
+	short ty = 0;
+
+	for (;;)
+	{
+		unsigned char skip = *s++;
+		unsigned char code = *s++;
+		register unsigned long *tile;
+		register unsigned long *d;
+		register short i;
+
+		if (code==0xfe && !skip)
+			break;
+
+		tx += skip;
+		while (tx>=width32)
+		{
+			tx -= width32;
+			ty++;
+		}
+
+		if (code==0xfe)
+			continue;
+
+		if (code==0xff)
+		{
+			tile = (unsigned long *)s;
+			s += kTileLongs*4;
+			TileAdd( ccb, tile );
+		}
+		else
+		{
+			tile = ccb->tiles+code*kTileLongs;
+			if ((ccb->tile_next+kTileSlots-1-code)%kTileSlots>=kTileSlots/2)
+				tile = TileAdd( ccb, tile );
+		}
+
+		if (same)
+			d = (unsigned long *)(ccb->baseAddr+ty*(long)kTileLongs*ccb->output_width8)+tx;
+		else
+			d = ccb->offsets32[ty*(long)kTileLongs*width32+tx];
+
+		for (i=0;i!=kTileLongs;i++)
+		{
+			*d = *tile++;
+			d += rowlongs;
+		}
+
+		tx++;
+	}
+
+	return (char *)s;
+}
+
+//	-------------------------------------------------------------------
+
+static void Tiles_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_same_ref( DrawTiles( source, ccb, TRUE ), ccb );
+}
+
+static void Tiles_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_all_ref( DrawTiles( source, ccb, FALSE ), ccb );
+}
+
+static void Tiles_same( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_same( DrawTiles( source, ccb, TRUE ), ccb );
+}
+
+static void Tiles_all( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_all( DrawTiles( source, ccb, FALSE ), ccb );
+}
+
+//	-------------------------------------------------------------------
+//	Codec 0x08 : regions (reference implementation)
+//	  Fills rectangles in white or black, or inverts them,
+//	  then fixes the rest like z32
+//	Format:
+//	  2 bytes       : number of rectangles
+//	  For each rectangle:
+//		2 bytes     : top line
+//		2 bytes     : number of lines
+//		1 byte      : left, in longs
+//		1 byte      : width, in longs
+//		2 bytes     : operation (0: white, 1: black, 2: invert)
+//	  z32 data      : residual
+//	-------------------------------------------------------------------
+
+static char *FillRegions( char *source, struct CodecControlBlock *ccb, Boolean same )
+{
+	register unsigned short *s = (unsigned short *)source;
+	short count = *s++;
+
+	while (count--)
+	{
+		short top = s[0];
+		short height = s[1];
+		short left = ((unsigned char *)s)[4];
+		short width = ((unsigned char *)s)[5];
+		short op = s[3];
+		short y;
+
+		s += 4;
+
+		for (y=top;y!=top+height;y++)
+		{
+			register unsigned long *d;
+			register short x;
+
+			if (same)
+				d = (unsigned long *)(ccb->baseAddr+y*(long)ccb->output_width8)+left;
+			else
+				d = ccb->offsets32[y*(long)ccb->source_width32+left];
+
+			x = width+1;
+			if (op==0)
+				while (--x)
+					*d++ = 0x00000000L;
+			else if (op==1)
+				while (--x)
+					*d++ = 0xffffffffL;
+			else
+				while (--x)
+					*d++ ^= 0xffffffffL;
+		}
+	}
+
+	return (char *)s;
+}
+
+//	-------------------------------------------------------------------
+
+static void Regions_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_same_ref( FillRegions( source, ccb, TRUE ), ccb );
+}
+
+static void Regions_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_all_ref( FillRegions( source, ccb, FALSE ), ccb );
+}
+
+static void Regions_same( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_same( FillRegions( source, ccb, TRUE ), ccb );
+}
+
+static void Regions_all( char *source, struct CodecControlBlock *ccb )
+{
+	UnpackZ32_all( FillRegions( source, ccb, FALSE ), ccb );
+}
+
+//	-------------------------------------------------------------------
+//	Codec 0x09 : multiple copy lines (reference implementation)
+//	Copies several series of horizontal lines
+//	On-disk data:
+//		2 bytes     : number of series
+//	  For each serie:
+//		2 bytes     : first line
+//		2 bytes     : number of lines
+//		lines bytes : data to copy
+//	-------------------------------------------------------------------
+
+static void MultiLines_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	short count = ((short*)source)[0];
+
+	source += 2;
+
+	while (count--)
+	{
+		short from = ((short*)source)[0];
+		long len = ((short*)source)[1]*(long)ccb->source_width8;
+
+		BlockMove( source+4, ccb->baseAddr+from*(long)ccb->output_width8, len );
+		source += 4+len;
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void MultiLines_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	short width = ccb->source_width8;
+	short count = ((short*)source)[0];
+
+	source += 2;
+
+	while (count--)
+	{
+		short y = ((short*)source)[0];
+		short lines = ((short*)source)[1];
+
+		source += 4;
+
+		while (lines--)
+		{
+			BlockMove( source, ccb->offsets32[y*(long)ccb->source_width32], width );
+			source += width;
+			y++;
+		}
+	}
+}
+
+//	-------------------------------------------------------------------
+//	Codec 0x0a : xor (reference implementation)
+//	Xors bytes with the screen, in screen order (left to right, then top to bottom)
+//	On-disk data:
+//	  A series of runs
+//		1 byte      : number of bytes to skip
+//		1 byte      : number of bytes to xor
+//		count bytes : values to xor
+//	  Skip and count of 0 end the data
+//	-------------------------------------------------------------------
+
+static void Xor_same_ref( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned char *d = ccb->baseAddr;
+	register unsigned char *s = (unsigned char *)source;
+
+	while (s[0] || s[1])
+	{
+		register short count = s[1];
+
+		d += s[0];
+		s += 2;
+
+		while (count--)
+			*d++ ^= *s++;
+	}
+}
+
+//	-------------------------------------------------------------------
+
+static void Xor_all_ref( char *source, struct CodecControlBlock *ccb )
+{
+	register unsigned char *s = (unsigned char *)source;
+	short width = ccb->source_width8;
+	long pos = 0;
+
+	while (s[0] || s[1])
+	{
+		short count = s[1];
+
+		pos += s[0];
+		s += 2;
+
+		while (count)
+		{
+				//	Bytes left in the line
+			short x = pos%width;
+			short len = width-x;
+			register unsigned char *d = (unsigned char *)ccb->offsets32[(pos/width)*ccb->source_width32]+x;
+
+			if (len>count)
+				len = count;
+			count -= len;
+			pos += len;
+
+			while (len--)
+				*d++ ^= *s++;
+		}
+	}
+}
+
 //	-------------------------------------------------------------------
 //	Registry functions
 //	The registry is responsible to select the appropriate functions
@@ -354,24 +882,48 @@ void CodecInit()
 	sProcs[0][0][2] = UnpackZ32_all;
 	sProcs[0][0][3] = Invert_all_ref;
 	sProcs[0][0][4] = CopyLines_all_ref;
+	sProcs[0][0][5] = Scroll_all;
+	sProcs[0][0][6] = UnpackZ32s_all;
+	sProcs[0][0][7] = Tiles_all;
+	sProcs[0][0][8] = Regions_all;
+	sProcs[0][0][9] = MultiLines_all_ref;
+	sProcs[0][0][10] = Xor_all_ref;
 
 	sProcs[0][1][0] = Null_ref;
 	sProcs[0][1][1] = Null_ref;
 	sProcs[0][1][2] = UnpackZ32_same;
 	sProcs[0][1][3] = Invert_same_ref;
 	sProcs[0][1][4] = CopyLines_same_ref;
+	sProcs[0][1][5] = Scroll_same;
+	sProcs[0][1][6] = UnpackZ32s_same;
+	sProcs[0][1][7] = Tiles_same;
+	sProcs[0][1][8] = Regions_same;
+	sProcs[0][1][9] = MultiLines_same_ref;
+	sProcs[0][1][10] = Xor_same_ref;
 
 	sProcs[1][0][0] = Null_ref;
 	sProcs[1][0][1] = Null_ref;
 	sProcs[1][0][2] = UnpackZ32_all_ref;
 	sProcs[1][0][3] = Invert_all_ref;
 	sProcs[1][0][4] = CopyLines_all_ref;
+	sProcs[1][0][5] = Scroll_all_ref;
+	sProcs[1][0][6] = UnpackZ32s_all_ref;
+	sProcs[1][0][7] = Tiles_all_ref;
+	sProcs[1][0][8] = Regions_all_ref;
+	sProcs[1][0][9] = MultiLines_all_ref;
+	sProcs[1][0][10] = Xor_all_ref;
 
 	sProcs[1][1][0] = Null_ref;
 	sProcs[1][1][1] = Null_ref;
 	sProcs[1][1][2] = UnpackZ32_same_ref;
 	sProcs[1][1][3] = Invert_same_ref;
 	sProcs[1][1][4] = CopyLines_same_ref;
+	sProcs[1][1][5] = Scroll_same_ref;
+	sProcs[1][1][6] = UnpackZ32s_same_ref;
+	sProcs[1][1][7] = Tiles_same_ref;
+	sProcs[1][1][8] = Regions_same_ref;
+	sProcs[1][1][9] = MultiLines_same_ref;
+	sProcs[1][1][10] = Xor_same_ref;
 }
 
 //	-------------------------------------------------------------------
@@ -17,10 +17,23 @@ typedef enum
 	kZ32,
 	kInvert,
 	kCopy,
+	kScroll,
+	kZ32Short,
+	kTiles,
+	kRegions,
+	kMultiLines,
+	kXor,
 
 	kCodecCount
 }	eCodec;
 
+//	-------------------------------------------------------------------
+//	The tiles codec keeps the last tiles it displayed (32x8 pixels each)
+//	-------------------------------------------------------------------
+
+#define kTileSlots		254
+#define kTileLongs		8
+
 //	-------------------------------------------------------------------
 //	Passed to the codec for display
 //	-------------------------------------------------------------------
@@ -41,6 +54,9 @@ struct CodecControlBlock
 	unsigned short output_width32;	//	Width of the output in long
 	
 	unsigned char *baseAddr;		//	Address of the top-left of the screen
+
+	unsigned long *tiles;			//	Tiles dictionary (kTileSlots*kTileLongs longs, only for flims that use kTiles)
+	short tile_next;				//	Slot of the next tile to be added (reset for each playback)
 };
 
 //	-------------------------------------------------------------------
@@ -363,6 +363,11 @@ void ScreenDispos( ScreenPtr scrn )
 		MyDisposPtr( scrn->ccb.offsets32 );
 		scrn->ccb.offsets32 = NULL;
 	}
+	if (scrn->ccb.tiles)
+	{
+		MyDisposPtr( scrn->ccb.tiles );
+		scrn->ccb.tiles = NULL;
+	}
 }
 
 //	-------------------------------------------------------------------
@@ -491,6 +496,23 @@ Boolean ScreenVideoPrepare( ScreenPtr scrn, short playback_left, short playback_
 	if (scrn->ccb.source_width8!=scrn->ccb.output_width8)
 		CreateOffsetTable( &scrn->ccb.offsets32, scrn->baseAddr, scrn->flim_width, scrn->flim_height, scrn->rowBytes*8 );
 
+		//	The tiles dictionary is only needed by flims that use the tiles codec
+		//	Without it, the screen would stay wrong, so the flim cannot be played
+	if (codecs&(1L<<kTiles))
+	{
+		if (!scrn->ccb.tiles)
+			scrn->ccb.tiles = (unsigned long *)MyNewPtr( kTileSlots*kTileLongs*sizeof(long) );
+		if (!scrn->ccb.tiles)
+			return FALSE;
+	}
+	else if (scrn->ccb.tiles)
+	{
+		MyDisposPtr( scrn->ccb.tiles );
+		scrn->ccb.tiles = NULL;
+	}
+		//	The tiles dictionary starts empty for each playback
+	scrn->ccb.tile_next = 0;
+
 	scrn->ready = TRUE;
 
 	return TRUE;
@@ -9,9 +9,13 @@
 #include <cstdint>
 #include <bit>
 #include <limits>
+#include <unordered_map>
 
 #include "framebuffer.hpp"
+#include "framediff.hpp"
+#include "tiledictionary.hpp"
 #include "ruler.hpp"
+#include "decoder.hpp"
 
 inline bool bool_from( const std::string &v )
 {
@@ -39,11 +43,33 @@ protected:
         return atoi(v.c_str());
     }
 
+        /// Runs the residual codec of a composite codec, from the screen its own operations left, within budget
+        /// The words it changes are added to patch, after the ones of the composite codec
+    std::vector<uint8_t> compress_residual( const compressor &residual, frame_patch &patch, const framebuffer &from, const framebuffer &target, const word_weights &weights, size_t budget ) const
+    {
+        frame_diff diff{ from, target };
+        frame_patch residual_patch{ W_ };
+        auto data = residual.compress( residual_patch, from, target, diff, weights, budget );
+        for (auto &e:residual_patch.entries())
+            patch.set_word( e.offset, e.value, e.mask );
+        return data;
+    }
+
 public:
     compressor( size_t width, size_t height ) : W_{width}, H_{height} {}
 
     virtual ~compressor() {}
-    virtual std::vector<uint8_t> compress( framebuffer &current, const framebuffer &target, /* weigths, */ size_t budget ) const = 0;
+        /// diff is the difference between current and target, computed once for all codecs
+        /// weights tells how much each word is worth updating (empty if they all are)
+        /// The words the encoded data changes on screen are written in patch
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const = 0;
+
+        /// Lower bound of the number of differences left on screen after compressing within budget
+        /// Used to skip codecs that cannot beat an already computed candidate
+    virtual size_t min_differences( [[maybe_unused]] const frame_diff &diff, [[maybe_unused]] size_t budget ) const
+    {
+        return 0;
+    }
 
     virtual bool set_parameter( const std::string parameter, const std::string value )
     {
@@ -52,8 +78,19 @@ public:
         return false;
     }
 
+        /// Called with the data that was chosen to be displayed
+        /// Codecs that share a state with the player update it here, as compress() is called for every candidate
+    virtual void commit( [[maybe_unused]] const std::vector<uint8_t> &data ) {}
+
+        /// Called when the encoding starts again from the first image (two-pass encoding)
+        /// Codecs that share a state with the player go back to the state it has when the flim starts
+    virtual void restart() {}
+
     virtual std::string name() const = 0;
 
+        /// True for codecs that rewrite large parts of the screen at once
+    virtual bool full_screen() const { return false; }
+
     virtual std::string description() const
     {
         return name();
@@ -67,7 +104,12 @@ public:
 
     null_compressor( size_t width, size_t height ) : compressor{ width, height } {}
 
-    virtual std::vector<uint8_t> compress( [[maybe_unused]] framebuffer &current, [[maybe_unused]] const framebuffer &target, /* weigths, */ [[maybe_unused]] size_t budget ) const
+    virtual size_t min_differences( const frame_diff &diff, [[maybe_unused]] size_t budget ) const
+    {
+        return diff.changed();
+    }
+
+    virtual std::vector<uint8_t> compress( [[maybe_unused]] frame_patch &patch, [[maybe_unused]] const framebuffer &current, [[maybe_unused]] const framebuffer &target, [[maybe_unused]] const frame_diff &diff, [[maybe_unused]] const word_weights &weights, [[maybe_unused]] size_t budget ) const
     {
         return {};
     }
@@ -80,9 +122,17 @@ public:
 
     invert_compressor( size_t width, size_t height ) : compressor{ width, height } {}
 
-    virtual std::vector<uint8_t> compress( framebuffer &current, [[maybe_unused]] const framebuffer &target, /* weigths, */ [[maybe_unused]] size_t budget ) const
+    virtual bool full_screen() const { return true; }
+
+    virtual size_t min_differences( const frame_diff &diff, [[maybe_unused]] size_t budget ) const
+    {
+        return diff.pixel_count()-diff.changed();
+    }
+
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, [[maybe_unused]] const framebuffer &target, [[maybe_unused]] const frame_diff &diff, [[maybe_unused]] const word_weights &weights, [[maybe_unused]] size_t budget ) const
     {
-        current = current.inverted();
+        for (size_t i=0;i!=diff.width32()*H_;i++)
+            patch.set_word( i, ~current.word( i ) );
         return {};
     }
 };
@@ -96,39 +146,73 @@ class copy_line_compressor : public compressor
         return compressor::set_parameter( parameter, value );
     }
 
-    virtual std::vector<uint8_t> compress( framebuffer &current, const framebuffer &target, /* weigths, */ size_t budget ) const
+protected:
+        /// Differences of each line, in pixels
+        /// With weights, the pixels count by the weight of their word, in 1/16th of pixels to stay in integers
+    std::vector<size_t> line_differences( const frame_diff &diff, const word_weights &weights ) const
     {
-        framebuffer result{current};
+        if (weights.empty())
+            return diff.line_counts();
+
+        std::vector<size_t> weighted( H_ );
+        for (size_t y=0;y!=H_;y++)
+            for (size_t x=0;x!=diff.width32();x++)
+                weighted[y] += mypopcount( diff.xor_word( x, y ) )*weights[y*diff.width32()+x]*16+0.5;
+        return weighted;
+    }
 
-        size_t q = 0;
+private:
+        /// Finds the band of lines that fits in the budget and fixes the most pixels
+        /// Returns the number of fixed pixels
+        /// With weights, the pixels count by the weight of their word, and the result is no longer a pixel count
+    size_t best_band( const frame_diff &diff, size_t budget, size_t &line_start, size_t &line_count, const word_weights &weights = {} ) const
+    {
+        line_start = 0;
+        line_count = 0;
 
-        size_t line_start = 0;
-        size_t line_count = 0;
+        size_t target_count = std::min( budget / get_bytes_width(), H_ );  //  est. 64 bytes per line
 
-        size_t target_count = budget / get_bytes_width();  //  est. 64 bytes per line
+            //  Sliding window over the per-line differences: the best band is the one that fixes the most pixels
+        auto differences = line_differences( diff, weights );
 
-// std::clog << "Lines: " << budget << " bytes " << target_count << " lines \n";
+        size_t window = std::accumulate( std::begin(differences), std::begin(differences)+target_count, (size_t)0 );
+        size_t q = window;
+        if (q>0)
+            line_count = target_count;
 
-        for (size_t i=0;i<current.H();i+=target_count)
+        for (size_t i=1;i+target_count<=H_;i++)
         {
-            framebuffer fb = current;
-            size_t lc = std::min( target_count, current.H()-i );
-            fb.copy_lines_from( target, i, lc );
-            auto res = fb.count_differences( current );
-            if (res>q)
+            window += differences[i+target_count-1];
+            window -= differences[i-1];
+            if (window>q)
             {
-                q = res;
-                result = fb;
-                // std::clog << "[" << q << "]";
+                q = window;
                 line_start = i;
-                line_count = lc;
+                line_count = target_count;
             }
         }
 
-// std::clog << "COPY LINES : line_count == " << line_count << "  line_count " << line_count << "\n";
-// std::clog << "COPY LINES : bytes_count == " << line_count*get_bytes_width() << "  offset " << line_start*get_bytes_width() << "\n";
+        return q;
+    }
+
+        //  No band fixes more differences than the unweighted best one, so this is a lower bound
+        //  (with weights, compress may copy another band, that leaves more differences)
+    virtual size_t min_differences( const frame_diff &diff, size_t budget ) const
+    {
+        size_t line_start, line_count;
+        return diff.changed()-best_band( diff, budget, line_start, line_count );
+    }
+
+    virtual std::vector<uint8_t> compress( frame_patch &patch, [[maybe_unused]] const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
+    {
+        size_t line_start;
+        size_t line_count;
+
+        best_band( diff, budget, line_start, line_count, weights );
 
-        current = result;       //  #### THIS SEEMS VERY WRONG! WE SHOULD APPLY THE LINES TO CURRENT OR RETURN THE BEST FB FROM ABOVE LOOP
+        for (size_t y=line_start;y!=line_start+line_count;y++)
+            for (size_t x=0;x!=diff.width32();x++)
+                patch.set( x, y, target.value<uint32_t>( x, y ) );
 
         std::vector<uint8_t> data;
         auto out = std::back_inserter( data );
@@ -143,6 +227,8 @@ class copy_line_compressor : public compressor
 
     public:
         copy_line_compressor( size_t width, size_t height ) : compressor{ width, height } {}
+
+        virtual bool full_screen() const { return true; }
 };
 
 /**
@@ -151,30 +237,110 @@ class copy_line_compressor : public compressor
 template <typename T>
 class vertical_compressor : public compressor
 {
-    virtual std::string name() const { char buffer[1024]; sprintf( buffer, "z%lu", sizeof(T)*8 ); return buffer; }
+    virtual std::string name() const { char buffer[1024]; sprintf( buffer, "z%lu%s", sizeof(T)*8, short_headers_?"s":"" ); return buffer; }
 
     const ruler<T> &ruler_;
 
+        //  Runs are encoded like z16 (2 bytes headers with a relative offset), even for z32
+    bool short_headers_;
+
         /// Width in underlying type
     size_t get_T_width() const { return get_bytes_width()/sizeof(T); }
 
         /// Number of element of type for the whole screen
     size_t get_T_size() const { return get_T_width()*H_; }
 
-    std::vector<run<T>> compress( size_t max_size, const std::vector<T> &target_data_, const std::vector<size_t> &delta_ ) const
+        //  Delta state, kept between the ticks of the same target
+        //  (valid for the target_id and revision of a frame_diff)
+    mutable size_t state_id_ = 0;
+    mutable size_t state_revision_ = 0;
+    mutable std::vector<T> target_data_;        //  The data we are trying to converge to (vertical)
+    mutable std::vector<size_t> delta_;         //  0: it is sync'ed
+    mutable std::vector<size_t> dirty_;         //  Indexes of the non-zero deltas, in vertical order
+
+        //  Importance of updating the element at x, y (in T units)
+    size_t delta_at( const framebuffer &current, const frame_diff &diff, const word_weights &weights, size_t x, size_t y ) const
+    {
+        size_t i = x*H_+y;
+        T current_value = current.value<T>( x, y );
+        if (current_value==target_data_[i])
+            return 0;
+
+            //  Let's increase the importance of updating this
+        size_t delta = ruler_.distance( target_data_[i], current_value );
+        if (!weights.empty())
+            delta = std::max( (size_t)1, (size_t)(delta*weights[y*diff.width32()+x*sizeof(T)/4]+0.5) );
+        return delta;
+    }
+
+        //  Brings the delta state up to date with current
+        //  If the last tick was done on the same target, only the words patched by it are recomputed
+    void update_state( const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights ) const
+    {
+        if (diff.target_id()==state_id_ && diff.revision()==state_revision_)
+            return;
+
+        if (diff.target_id()==state_id_ && diff.revision()==state_revision_+1)
+        {
+            std::vector<size_t> now_dirty;
+            for (auto offset:diff.updated())
+            {
+                size_t y = offset/diff.width32();
+                for (size_t x=(offset%diff.width32())*4/sizeof(T);x!=(offset%diff.width32()+1)*4/sizeof(T);x++)
+                {
+                    size_t i = x*H_+y;
+                    bool was_dirty = delta_[i]!=0;
+                    delta_[i] = delta_at( current, diff, weights, x, y );
+                    if (!was_dirty && delta_[i]!=0)
+                        now_dirty.push_back( i );
+                }
+            }
+
+            std::vector<size_t> dirty;
+            std::copy_if( std::begin(dirty_), std::end(dirty_), std::back_inserter(dirty), [&]( auto i ) { return delta_[i]!=0; } );
+            std::sort( std::begin(now_dirty), std::end(now_dirty) );
+            dirty_.clear();
+            std::merge( std::begin(dirty), std::end(dirty), std::begin(now_dirty), std::end(now_dirty), std::back_inserter(dirty_) );
+        }
+        else
+        {
+            target_data_ = target.raw_values<T>();
+            delta_.assign( get_T_size(), 0 );
+            dirty_.clear();
+
+                //  Only the dirty part of each strip needs to be looked at
+            for (size_t x=0;x!=get_T_width();x++)
+            {
+                size_t strip = x*sizeof(T)/4;
+                for (size_t y=diff.strip_begin( strip );y<diff.strip_end( strip );y++)
+                {
+                    size_t i = x*H_+y;
+                    delta_[i] = delta_at( current, diff, weights, x, y );
+                    if (delta_[i])
+                        dirty_.push_back( i );
+                }
+            }
+        }
+
+        state_id_ = diff.target_id();
+        state_revision_ = diff.revision();
+    }
+
+    std::vector<run<T>> compress( size_t max_size, const std::vector<T> &target_data_, const std::vector<size_t> &delta_, const std::vector<size_t> &dirty_ ) const
     {
-        size_t header_size = sizeof(T)==4?4:2;
+        size_t header_size = sizeof(T)==4 && !short_headers_?4:2;
 
         packzmap packmap{ get_T_size(), header_size, sizeof(T) };
 
-        auto mx = *std::max_element( std::begin(delta_), std::end(delta_) );
+        size_t mx = 0;
+        for (auto ix:dirty_)
+            mx = std::max( mx, delta_[ix] );
 
         std::vector<std::vector<size_t>> deltas;
         deltas.resize( mx+1 );
 
-        for (size_t i=0;i!=get_T_size();i++)
-            if (delta_[i])
-                deltas[delta_[i]].push_back( i );
+        for (auto ix:dirty_)
+            deltas[delta_[ix]].push_back( ix );
 
         bool done = false;
 
@@ -193,7 +359,8 @@ class vertical_compressor : public compressor
                 break;
 
             //  We add the borders of the packmap if not "expensive"
-            for (size_t ix=0;ix!=get_T_size();ix++)
+            //  (clean elements have a zero delta, so are never added)
+            for (auto ix:dirty_)
                 if (((ix%H_)!=0) && ((ix%H_)!=H_-1) && packmap.empty_border(ix))
                     if (delta_[ix]*2>=i)
                         if (packmap.set(ix)>=max_size)
@@ -213,7 +380,8 @@ class vertical_compressor : public compressor
             std::end( packmap.mask() ),
             max_size,
             W_/8/sizeof(T),
-            H_
+            H_,
+            header_size
         );
 
         if (verbose_)
@@ -223,8 +391,16 @@ class vertical_compressor : public compressor
     }
 
 public:
-    vertical_compressor( size_t W, size_t H, const ruler<T> &ruler ) :  compressor{ W, H }, ruler_{ruler}
+    vertical_compressor( size_t W, size_t H, const ruler<T> &ruler, bool short_headers=false ) :  compressor{ W, H }, ruler_{ruler}, short_headers_{short_headers}
+    {
+    }
+
+        //  Each byte of data fixes at most 8 pixels
+    virtual size_t min_differences( const frame_diff &diff, size_t budget ) const
     {
+        if (diff.changed()<=budget*8)
+            return 0;
+        return diff.changed()-budget*8;
     }
 
 size_t vertical_from_horizontal( size_t h ) const
@@ -244,28 +420,12 @@ size_t vertical_from_horizontal( size_t h ) const
 }
 
 
-    virtual std::vector<uint8_t> compress( framebuffer &current, const framebuffer &target, /* weigths, */ size_t budget ) const
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
     {
 // std::cerr << "BUDGET:" << budget << "\n";
 
-            //  transient
-        auto current_data_ = current.raw_values<T>();    //  The data present on screen (for optimisation purposes) (vertical)
-        auto target_data_ = target.raw_values<T>();      //  The data we are trying to converge to
-        std::vector<size_t> delta_(get_T_size());        //  0: it is sync'ed
+        update_state( current, target, diff, weights );
 
-        for (size_t i=0;i!=get_T_size();i++)
-        {
-            if (current_data_[i]==target_data_[i])
-                    //  Data is identical, we don't care about updating this
-                delta_[i] = 0;
-            else
-            {
-                    //  Let's increase the importance of updating this
-                // delta_[i] += countbits( target_data_[i] ^ current_data_[i] );
-                delta_[i] = ruler_.distance( target_data_[i], current_data_[i] );
-            }
-
-        }
             //  Display delta map in correct order
         if (verbose_)
         {
@@ -281,7 +441,7 @@ size_t vertical_from_horizontal( size_t h ) const
         if (verbose_)
             std::clog << "]\n";
 
-        auto runs = compress( budget, target_data_, delta_ );
+        auto runs = compress( budget, target_data_, delta_, dirty_ );
 
         for (auto &run:runs)
             if (run.offset>=get_T_size())
@@ -293,8 +453,8 @@ size_t vertical_from_horizontal( size_t h ) const
             //  Encode the runs
         std::vector<uint8_t> res;
 
-        const int max_run_len = 127;
-            //  Runs must not contain more than 256 bytes
+            //  Runs must not contain more than 256 bytes (z32s has a full byte for the count)
+        const int max_run_len = short_headers_?255:127;
         std::vector<run<T>> smaller;
         for (auto &run:runs)
         {
@@ -338,7 +498,20 @@ size_t vertical_from_horizontal( size_t h ) const
         for (auto &run:closer)
             assert( run.offset<get_T_size() );
 
-        if (sizeof(T)==4)
+            //  The packmap does not know about the split and skip headers: drop the last runs if they make us go over budget
+        if (short_headers_)
+        {
+            size_t size = 2;
+            for (auto &run:closer)
+                size += 2+run.data.size()*sizeof(T);
+            while (size>budget && !closer.empty())
+            {
+                size -= 2+closer.back().data.size()*sizeof(T);
+                closer.pop_back();
+            }
+        }
+
+        if (sizeof(T)==4 && !short_headers_)
             closer = runs;
 
         if (verbose_)
@@ -356,19 +529,20 @@ size_t vertical_from_horizontal( size_t h ) const
                 {
 
                     auto offset = vertical_from_horizontal( run.offset )+i;
+                    T current_value = current.value<T>( offset/H_, offset%H_ );
 
                     if (sizeof(T)==2)
-                        fprintf( stderr, "%04x ", run.data[i]^current_data_[offset] );
+                        fprintf( stderr, "%04x ", run.data[i]^current_value );
                     else
                     {
                         fprintf(
                             stderr,
                             "%08x ",
-                            run.data[i]^current_data_[offset]
+                            run.data[i]^current_value
                             );
                     }
 
-                    bits_changed += mypopcount( (T)(run.data[i]^current_data_[offset]) );
+                    bits_changed += mypopcount( (T)(run.data[i]^current_value) );
                 }
                 std::clog << "]  ";
                 item_count += run.data.size();
@@ -377,7 +551,7 @@ size_t vertical_from_horizontal( size_t h ) const
         }
 
             //  Encode Z32
-        if (sizeof(T)==4)
+        if (sizeof(T)==4 && !short_headers_)
         {
             for (auto &run:closer)
             {
@@ -394,13 +568,14 @@ size_t vertical_from_horizontal( size_t h ) const
             res.push_back( 0x00 );
         }
 
-            //  Encode Z16
-        if (sizeof(T)==2)
+            //  Encode Z16 and Z32s
+            //  The offset is relative to the previous run, empty runs are used to skip more than 255 items
+        if (sizeof(T)==2 || short_headers_)
         {
             size_t current = 0;
             for (auto &run:closer)
             {
-                uint16_t header = ((run.offset-current)<<8)+run.data.size();    //  oooooooo 0 sssssss
+                uint16_t header = ((run.offset-current)<<8)+run.data.size();    //  oooooooo 0 sssssss (z32s: oooooooo ssssssss)
                 current = run.offset;
 
                 auto v = from_value( header );
@@ -429,16 +604,854 @@ size_t vertical_from_horizontal( size_t h ) const
             for (auto &v:run.data)
             {
                 assert( offset<get_T_size() );
-                current_data_[offset] = v;
-                delta_[offset] = 0;
+                patch.set( offset/H_, offset%H_, v );
                 offset++;
             }
         }
 
-        current = framebuffer{current_data_, W_, H_};
+        return res;
+    }
+};
+
+/**
+ * Moves a band of lines up or down (and by whole bytes left or right), then fixes the rest like z32
+ * Made for rolling credits, scrolling text and pans, where the content is the same but shifted
+ */
+class scroll_compressor : public compressor
+{
+    virtual std::string name() const { return "scroll"; };
+
+    vertical_compressor<uint32_t> residual_;
+    int max_dx_ = 8;                            //  Largest horizontal move searched, in bytes
+
+    static const size_t header_size = 8;
+    static const size_t min_matches = 4;        //  Number of lines that must match for a move to be used
+    static const size_t max_repeats = 8;        //  Lines found more often than this (ie: blank ones) do not vote
 
+    struct displacement
+    {
+        size_t from = 0;        //  First line of the band
+        size_t count = 0;       //  Number of lines of the band (0: no move)
+        int dy = 0;             //  Vertical move, in lines
+        int dx = 0;             //  Horizontal move, in bytes
+    };
+
+        //  Hash of len bytes of each line, starting at skip
+    std::vector<uint64_t> line_hashes( const framebuffer &fb, size_t skip, size_t len ) const
+    {
+        std::vector<uint64_t> res( H_ );
+        for (size_t y=0;y!=H_;y++)
+        {
+            uint64_t h = 0xcbf29ce484222325;
+            const uint8_t *p = fb.line( y )+skip;
+            for (size_t i=0;i!=len;i++)
+                h = (h^p[i])*0x100000001b3;
+            res[y] = h;
+        }
         return res;
     }
+
+        //  Finds the move that brings the most changed lines of target from lines of current
+        //  For every horizontal move, lines are matched by hash and vote for their vertical move
+        //  Lines are compared without the max_dx_ bytes on each side, where content enters on horizontal moves
+    displacement find_displacement( const framebuffer &current, const framebuffer &target, const frame_diff &diff ) const
+    {
+        displacement best;
+        size_t best_votes = 0;
+        size_t len = get_bytes_width()-2*max_dx_;
+        auto to = line_hashes( target, max_dx_, len );
+
+        for (int dx=-max_dx_;dx<=max_dx_;dx++)
+        {
+            auto from = line_hashes( current, max_dx_-dx, len );
+
+            std::unordered_map<uint64_t,std::vector<int>> lines;
+            for (size_t y=0;y!=H_;y++)
+                lines[from[y]].push_back( y );
+
+            std::vector<size_t> votes( 2*H_ );
+            for (size_t y=0;y!=H_;y++)
+            {
+                if (!diff.line_counts()[y])
+                    continue;
+                auto it = lines.find( to[y] );
+                if (it==std::end(lines) || it->second.size()>max_repeats)
+                    continue;
+                for (auto source:it->second)
+                    votes[(int)y-source+(int)H_]++;
+            }
+
+            for (size_t i=0;i!=votes.size();i++)
+                if (votes[i]>best_votes && (dx!=0 || i!=H_))
+                {
+                    best_votes = votes[i];
+                    best.dy = (int)i-(int)H_;
+                    best.dx = dx;
+                }
+        }
+
+        if (best_votes<min_matches)
+            return {};
+
+            //  The band is the run of lines where the move fixes the most pixels
+            //  Lines that the move leaves as they are (blank ones) fix nothing, so they do not extend it,
+            //  and static lines (a title above rolling credits) get worse, so they are not moved
+        size_t rowbytes = get_bytes_width();
+        long sum = 0;
+        long best_sum = 0;
+        size_t start = 0;
+        for (size_t y=0;y!=H_;y++)
+        {
+            int source = (int)y-best.dy;
+            if (source<0 || source>=(int)H_)
+            {
+                sum = 0;
+                continue;
+            }
+
+            const uint8_t *moved = current.line( source );
+            const uint8_t *kept = current.line( y );
+            const uint8_t *wanted = target.line( y );
+            long wrong = 0;
+            for (size_t i=0;i!=rowbytes;i++)
+            {
+                long j = (long)i-best.dx;
+                uint8_t v = j>=0 && j<(long)rowbytes?moved[j]:kept[i];
+                wrong += mypopcount( v^wanted[i] );
+            }
+
+            if (sum<=0)
+            {
+                sum = 0;
+                start = y;
+            }
+            sum += (long)diff.line_counts()[y]-wrong;
+            if (sum>best_sum)
+            {
+                best_sum = sum;
+                best.from = start;
+                best.count = y+1-start;
+            }
+        }
+
+        return best;
+    }
+
+public:
+    scroll_compressor( size_t W, size_t H ) : compressor{ W, H }, residual_{ W, H, uint32_ruler::ruler } {}
+
+    virtual bool set_parameter( const std::string parameter, const std::string value )
+    {
+        if (parameter=="max-dx")
+        {
+            max_dx_ = std::min( size_t_from( value ), get_bytes_width()/4 );
+            return true;
+        }
+        return compressor::set_parameter( parameter, value );
+    }
+
+        /// Format: first line, line count, vertical move (lines) and horizontal move (bytes),
+        /// as 2 bytes each (moves are signed), followed by z32 data for the residual
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
+    {
+        auto move = find_displacement( current, target, diff );
+
+        std::vector<uint8_t> data;
+        auto out = std::back_inserter( data );
+        write2( out, move.from );
+        write2( out, move.count );
+        write2( out, (uint16_t)move.dy );
+        write2( out, (uint16_t)move.dx );
+
+            //  Without a move, this is z32 with 8 more bytes, but it must still converge on its own
+        framebuffer moved = current;
+        if (move.count)
+        {
+            moved.scroll_lines( move.from, move.count, move.dy, move.dx );
+            for (size_t offset=move.from*diff.width32();offset!=(move.from+move.count)*diff.width32();offset++)
+                if (moved.word( offset )!=current.word( offset ))
+                    patch.set_word( offset, moved.word( offset ) );
+        }
+
+            //  The residual is written after the move, so it overrides it in the patch
+        auto residual = compress_residual( residual_, patch, moved, target, weights, budget>header_size?budget-header_size:0 );
+
+        data.insert( std::end(data), std::begin(residual), std::end(residual) );
+        return data;
+    }
+};
+
+/**
+ * Sends the changed 32x8 tiles as references to the tiles it sent before, or whole, then fixes the rest like z32
+ * Made for cartoons, screen recordings and HyperCard stacks, where the same tiles keep coming back
+ */
+class tile_compressor : public compressor
+{
+    virtual std::string name() const { return "tiles"; };
+
+    vertical_compressor<uint32_t> residual_;
+    size_t min_words_ = 6;                      //  Changed words for a tile that is not in the dictionary to be sent whole
+
+    static const uint8_t Skip = 0xfe;
+    static const uint8_t Literal = 0xff;
+    static const size_t TileHeight = tile_dictionary::TileHeight;
+
+    tile_dictionary dictionary_;                //  The tiles the player knows
+    mutable tile_dictionary pending_;           //  The tiles the player will know after displaying pending_data_
+    mutable std::vector<uint8_t> pending_data_;
+
+    struct candidate
+    {
+        size_t index;           //  Tile index, in natural order
+        double value;           //  Weighted number of pixels it fixes
+        bool known;             //  In the dictionary
+    };
+
+public:
+    tile_compressor( size_t W, size_t H ) : compressor{ W, H }, residual_{ W, H, uint32_ruler::ruler } {}
+
+    virtual bool set_parameter( const std::string parameter, const std::string value )
+    {
+        if (parameter=="min-words")
+        {
+            min_words_ = size_t_from( value );
+            return true;
+        }
+        return compressor::set_parameter( parameter, value );
+    }
+
+    virtual void commit( const std::vector<uint8_t> &data )
+    {
+        if (data==pending_data_)
+        {
+            dictionary_ = pending_;
+            return;
+        }
+
+            //  Not the data of the last compress(): the dictionary is updated by decoding it, like the player does
+        framebuffer scratch{ W_, H_ };
+        decode_tiles( scratch, dictionary_, data.data(), data.size() );
+    }
+
+    virtual void restart()
+    {
+        dictionary_.reset();
+        pending_data_.clear();
+    }
+
+        /// Format: a series of 2 bytes commands, followed by z32 data for the residual
+        /// A command is the number of tiles to skip (1 byte) then either a dictionary slot,
+        /// Literal followed by the 32 bytes of the tile, or Skip (only moves, Skip with no move ends the commands)
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
+    {
+        size_t width32 = diff.width32();
+        size_t rows = H_/TileHeight;
+
+            //  The tiles worth sending
+        std::vector<candidate> candidates;
+        for (size_t ty=0;ty!=rows;ty++)
+            for (size_t tx=0;tx!=width32;tx++)
+            {
+                size_t words = 0;
+                double value = 0;
+                for (size_t y=ty*TileHeight;y!=(ty+1)*TileHeight;y++)
+                {
+                    size_t offset = y*width32+tx;
+                    uint32_t changed = current.word( offset )^target.word( offset );
+                    if (changed)
+                    {
+                        words++;
+                        value += mypopcount( changed )*(weights.empty()?1:weights[offset]);
+                    }
+                }
+                if (!words)
+                    continue;
+                bool known = dictionary_.find( tile_dictionary::tile_at( target, tx, ty*TileHeight ) )>=0;
+                if (known || words>=min_words_)
+                    candidates.push_back( { ty*width32+tx, value, known } );
+            }
+
+            //  References are the cheapest, then the tiles that fix the most
+        std::stable_sort( std::begin(candidates), std::end(candidates), []( auto &a, auto &b ) { return a.known!=b.known?a.known:a.value>b.value; } );
+
+            //  Room for the end of the commands, the end of the z32 data and as many long skips as the screen can need
+        size_t size = 2+4+rows*width32/255*2;
+        std::vector<bool> chosen( rows*width32 );
+        std::vector<bool> known( rows*width32 );
+        for (auto &c:candidates)
+        {
+            size_t cost = c.known?2:2+TileHeight*4;
+            if (size+cost>budget)
+                continue;
+            size += cost;
+            chosen[c.index] = true;
+            known[c.index] = c.known;
+        }
+
+            //  Commands are written in screen order, updating the dictionary like the player will
+        pending_ = dictionary_;
+        framebuffer tiled = current;
+        std::vector<uint8_t> data;
+        auto out = std::back_inserter( data );
+        size_t cursor = 0;
+        for (size_t index=0;index!=chosen.size();index++)
+        {
+            if (!chosen[index])
+                continue;
+
+            size_t tx = index%width32;
+            size_t ty = index/width32;
+            auto t = tile_dictionary::tile_at( target, tx, ty*TileHeight );
+            int slot = pending_.find( t );
+                //  Replaced by a tile sent earlier in this frame: the residual will do
+            if (slot<0 && known[index])
+                continue;
+
+            while (index-cursor>255)
+            {
+                write1( out, 255 );
+                write1( out, Skip );
+                cursor += 255;
+            }
+            write1( out, index-cursor );
+            cursor = index+1;
+
+            if (slot>=0)
+            {
+                write1( out, slot );
+                pending_.use( slot );
+            }
+            else
+            {
+                write1( out, Literal );
+                for (auto v:t)
+                    write4( out, v );
+                pending_.insert( t );
+            }
+
+            for (size_t i=0;i!=TileHeight;i++)
+            {
+                size_t offset = (ty*TileHeight+i)*width32+tx;
+                tiled.set_word( offset, t[i] );
+                patch.set_word( offset, t[i] );
+            }
+        }
+        write1( out, 0 );
+        write1( out, Skip );
+
+            //  The residual is written after the tiles, so it overrides them in the patch
+        auto residual = compress_residual( residual_, patch, tiled, target, weights, budget>data.size()?budget-data.size():0 );
+
+        data.insert( std::end(data), std::begin(residual), std::end(residual) );
+        pending_data_ = data;
+        return data;
+    }
+};
+
+/**
+ * Fills rectangles in white or black, or inverts them, then fixes the rest like z32
+ * Made for fades, flashes and windows opening, where large parts of the screen change the same way
+ */
+class region_compressor : public compressor
+{
+    virtual std::string name() const { return "regions"; };
+
+    vertical_compressor<uint32_t> residual_;
+    size_t max_rects_ = 8;                      //  Rectangles per frame
+    long min_gain_ = 256;                       //  Pixels a rectangle must fix (net of the ones it breaks)
+
+    static const size_t rect_size = 8;
+
+    enum operation { White=0, Black=1, Invert=2 };
+
+    struct rect
+    {
+        size_t top;
+        size_t height;
+        size_t left;            //  In 32 pixels words
+        size_t width;           //  In 32 pixels words
+        operation op;
+        long gain;              //  Pixels fixed minus pixels broken
+    };
+
+    static uint32_t apply( operation op, uint32_t v )
+    {
+        if (op==White)
+            return 0x00000000;
+        if (op==Black)
+            return 0xffffffff;
+        return ~v;
+    }
+
+        //  Net number of pixels fixed by applying r on current
+    long gain( const framebuffer &current, const framebuffer &target, const rect &r ) const
+    {
+        size_t width32 = W_/32;
+        long res = 0;
+        for (size_t y=r.top;y!=r.top+r.height;y++)
+            for (size_t x=r.left;x!=r.left+r.width;x++)
+            {
+                uint32_t v = current.word( y*width32+x );
+                uint32_t t = target.word( y*width32+x );
+                res += (long)mypopcount( v^t )-(long)mypopcount( apply( r.op, v )^t );
+            }
+        return res;
+    }
+
+        //  Bounding boxes of the groups of connected changed words where op removes at least half of the differences
+        //  Groups that do not fix min_gain_ pixels by themselves are ignored
+    std::vector<rect> regions( const framebuffer &current, const framebuffer &target, const frame_diff &diff, operation op ) const
+    {
+        size_t width32 = diff.width32();
+        auto good = [&]( size_t offset )
+        {
+            uint32_t changed = diff.xor_word( offset%width32, offset/width32 );
+            return changed && mypopcount( apply( op, current.word( offset ) )^target.word( offset ) )*2<=mypopcount( changed );
+        };
+
+        std::vector<rect> res;
+        std::vector<bool> seen( width32*H_ );
+        std::vector<size_t> stack;
+        for (size_t start=0;start!=seen.size();start++)
+        {
+            if (seen[start] || !good( start ))
+                continue;
+
+            rect r{ start/width32, 1, start%width32, 1, op, 0 };
+            size_t right = r.left;
+            size_t bottom = r.top;
+            long fixed = 0;
+
+            seen[start] = true;
+            stack.push_back( start );
+            while (!stack.empty())
+            {
+                size_t offset = stack.back();
+                stack.pop_back();
+
+                size_t x = offset%width32;
+                size_t y = offset/width32;
+                r.left = std::min( r.left, x );
+                right = std::max( right, x );
+                r.top = std::min( r.top, y );
+                bottom = std::max( bottom, y );
+                fixed += (long)mypopcount( diff.xor_word( x, y ) )-(long)mypopcount( apply( op, current.word( offset ) )^target.word( offset ) );
+
+                auto visit = [&]( size_t next )
+                {
+                    if (!seen[next] && good( next ))
+                    {
+                        seen[next] = true;
+                        stack.push_back( next );
+                    }
+                };
+                if (x>0)
+                    visit( offset-1 );
+                if (x+1<width32)
+                    visit( offset+1 );
+                if (y>0)
+                    visit( offset-width32 );
+                if (y+1<H_)
+                    visit( offset+width32 );
+            }
+
+            if (fixed<min_gain_)
+                continue;
+
+            r.width = right+1-r.left;
+            r.height = bottom+1-r.top;
+            r.gain = gain( current, target, r );
+            if (r.gain>=min_gain_)
+                res.push_back( r );
+        }
+
+        return res;
+    }
+
+public:
+    region_compressor( size_t W, size_t H ) : compressor{ W, H }, residual_{ W, H, uint32_ruler::ruler } {}
+
+    virtual bool set_parameter( const std::string parameter, const std::string value )
+    {
+        if (parameter=="max-rects")
+        {
+            max_rects_ = size_t_from( value );
+            return true;
+        }
+        if (parameter=="min-gain")
+        {
+            min_gain_ = size_t_from( value );
+            return true;
+        }
+        return compressor::set_parameter( parameter, value );
+    }
+
+        /// Format: number of rectangles (2 bytes), then for each: top line, line count, left and width
+        /// (in 32 pixels words, 1 byte each) and operation (0: white, 1: black, 2: invert), as 2 bytes each,
+        /// followed by z32 data for the residual
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
+    {
+        std::vector<rect> candidates;
+        for (auto op:{ White, Black, Invert })
+        {
+            auto r = regions( current, target, diff, op );
+            candidates.insert( std::end(candidates), std::begin(r), std::end(r) );
+        }
+        std::sort( std::begin(candidates), std::end(candidates), []( auto &a, auto &b ) { return a.gain>b.gain; } );
+
+            //  Rectangles are applied in order, so the gain of each is checked after the previous ones
+        size_t width32 = diff.width32();
+        framebuffer filled = current;
+        std::vector<rect> rects;
+        for (auto &r:candidates)
+        {
+            if (rects.size()==max_rects_ || 2+(rects.size()+1)*rect_size+4>budget)
+                break;
+            if (gain( filled, target, r )<min_gain_)
+                continue;
+            for (size_t y=r.top;y!=r.top+r.height;y++)
+                for (size_t x=r.left;x!=r.left+r.width;x++)
+                    filled.set_word( y*width32+x, apply( r.op, filled.word( y*width32+x ) ) );
+            rects.push_back( r );
+        }
+
+        std::vector<uint8_t> data;
+        auto out = std::back_inserter( data );
+        write2( out, rects.size() );
+        for (auto &r:rects)
+        {
+            write2( out, r.top );
+            write2( out, r.height );
+            write1( out, r.left );
+            write1( out, r.width );
+            write2( out, r.op );
+        }
+
+        for (size_t offset=0;offset!=width32*H_;offset++)
+            if (filled.word( offset )!=current.word( offset ))
+                patch.set_word( offset, filled.word( offset ) );
+
+            //  The residual is written after the rectangles, so it overrides them in the patch
+        auto residual = compress_residual( residual_, patch, filled, target, weights, budget>data.size()?budget-data.size():0 );
+
+        data.insert( std::end(data), std::begin(residual), std::end(residual) );
+        return data;
+    }
+};
+
+/**
+ * Copies up to max-ranges separate bands of lines, for when several parts of the screen change at once
+ * (ie: subtitles and a moving object)
+ */
+class multi_line_compressor : public copy_line_compressor
+{
+    virtual std::string name() const { return "mlines"; };
+
+    size_t max_ranges_ = 4;
+
+    static const size_t header_size = 2;
+    static const size_t range_header_size = 4;
+
+    struct range
+    {
+        size_t from;
+        size_t count;
+    };
+
+        //  The ranges that fix the most differences within budget
+        //  Dynamic program over the lines, for each number of ranges and of copied lines:
+        //  the best value with the current line outside a range, or inside one
+    std::vector<range> best_ranges( const std::vector<size_t> &differences, size_t budget, size_t &value ) const
+    {
+        value = 0;
+        if (budget<header_size+range_header_size+get_bytes_width())
+            return {};
+
+        size_t K = max_ranges_;
+        size_t L = std::min( (budget-header_size-range_header_size)/get_bytes_width(), H_ );
+        const long none = -1;
+
+        auto at = [&]( size_t k, size_t l ) { return k*(L+1)+l; };
+        std::vector<long> out( (K+1)*(L+1), none );
+        std::vector<long> in( (K+1)*(L+1), none );
+        out[at(0,0)] = 0;
+
+            //  For each line and state: out comes from in (a range ended), in is a new range
+        const uint8_t OutFromIn = 1;
+        const uint8_t InIsNew = 2;
+        std::vector<uint8_t> choices( H_*(K+1)*(L+1) );
+
+        std::vector<long> next_out( (K+1)*(L+1) );
+        std::vector<long> next_in( (K+1)*(L+1) );
+        for (size_t y=0;y!=H_;y++)
+        {
+            uint8_t *choice = choices.data()+y*(K+1)*(L+1);
+            for (size_t k=0;k<=K;k++)
+                for (size_t l=0;l<=L;l++)
+                {
+                    size_t i = at(k,l);
+                    next_out[i] = out[i];
+                    if (in[i]>next_out[i])
+                    {
+                        next_out[i] = in[i];
+                        choice[i] = OutFromIn;
+                    }
+
+                    next_in[i] = none;
+                    if (k==0 || l==0)
+                        continue;
+                    long continued = in[at(k,l-1)];
+                    long started = out[at(k-1,l-1)];
+                    long best = std::max( continued, started );
+                    if (best==none)
+                        continue;
+                    next_in[i] = best+differences[y];
+                    if (started>continued)
+                        choice[i] |= InIsNew;
+                }
+            out.swap( next_out );
+            in.swap( next_in );
+        }
+
+            //  Best end state that fits in the budget
+        bool end_in = false;
+        size_t k = 0;
+        size_t l = 0;
+        long best = 0;
+        for (size_t kk=1;kk<=K;kk++)
+            for (size_t ll=1;ll<=L;ll++)
+            {
+                if (header_size+kk*range_header_size+ll*get_bytes_width()>budget)
+                    break;
+                for (bool is_in:{ false, true })
+                {
+                    long v = is_in?in[at(kk,ll)]:out[at(kk,ll)];
+                    if (v>best)
+                    {
+                        best = v;
+                        end_in = is_in;
+                        k = kk;
+                        l = ll;
+                    }
+                }
+            }
+        value = best;
+
+            //  Walk back through the lines
+        std::vector<range> res;
+        size_t end = H_;
+        for (size_t y=H_;y--;)
+        {
+                //  Line y is outside of the ranges, the line above may end one
+            if (!end_in)
+            {
+                if (choices[y*(K+1)*(L+1)+at(k,l)]&OutFromIn)
+                {
+                    end_in = true;
+                    end = y;
+                }
+                continue;
+            }
+            bool is_new = choices[y*(K+1)*(L+1)+at(k,l)]&InIsNew;
+            l--;
+            if (is_new)
+            {
+                res.push_back( { y, end-y } );
+                k--;
+                end_in = false;
+            }
+        }
+        std::reverse( std::begin(res), std::end(res) );
+
+        return res;
+    }
+
+public:
+    multi_line_compressor( size_t width, size_t height ) : copy_line_compressor{ width, height } {}
+
+    virtual bool set_parameter( const std::string parameter, const std::string value )
+    {
+        if (parameter=="max-ranges")
+        {
+            max_ranges_ = std::max( size_t_from( value ), (size_t)1 );
+            return true;
+        }
+        return compressor::set_parameter( parameter, value );
+    }
+
+        //  Lower bound: the ranges chosen on raw line differences fix the most differences
+        //  that max_ranges_ ranges can, whatever ranges the weights make compress pick
+    virtual size_t min_differences( const frame_diff &diff, size_t budget ) const
+    {
+        size_t value;
+        best_ranges( diff.line_counts(), budget, value );
+        return diff.changed()-value;
+    }
+
+        /// Format: number of ranges (2 bytes), then for each: first line and number of lines (2 bytes each),
+        /// followed by the content of the lines
+    virtual std::vector<uint8_t> compress( frame_patch &patch, [[maybe_unused]] const framebuffer &current, const framebuffer &target, const frame_diff &diff, const word_weights &weights, size_t budget ) const
+    {
+        size_t value;
+        auto ranges = best_ranges( line_differences( diff, weights ), budget, value );
+
+        std::vector<uint8_t> data;
+        auto out = std::back_inserter( data );
+        write2( out, ranges.size() );
+        for (auto &r:ranges)
+        {
+            write2( out, r.from );
+            write2( out, r.count );
+            target.extract( out, 0, r.from, r.count*get_bytes_width() );
+
+            for (size_t y=r.from;y!=r.from+r.count;y++)
+                for (size_t x=0;x!=diff.width32();x++)
+                    patch.set( x, y, target.value<uint32_t>( x, y ) );
+        }
+
+        return data;
+    }
+};
+
+/**
+ * Xors the screen with runs of bytes, in screen order, described as skip and literal counts
+ * Made for dense changes, where z32 spends most of its budget in run headers
+ * Stops at the budget, so the top of the screen is updated first
+ */
+class xor_compressor : public compressor
+{
+    virtual std::string name() const { return "xor"; };
+
+    static const size_t max_count = 255;
+    static const size_t min_skip = 3;       //  Shorter skips cost as much as sending the zeros
+
+    static const uint64_t ones = 0x0101010101010101;
+    static const uint64_t highs = 0x8080808080808080;
+
+        //  Bytes are checked 8 at a time, the exact position is found in the 8 bytes that matter
+
+        //  First non zero byte from i
+    static size_t next_non_zero( const uint8_t *p, size_t i, size_t end )
+    {
+        for (;i+8<=end;i+=8)
+        {
+            uint64_t v;
+            memcpy( &v, p+i, 8 );
+            if (v)
+                break;
+        }
+        while (i<end && !p[i])
+            i++;
+        return i;
+    }
+
+        //  First zero byte from i
+    static size_t next_zero( const uint8_t *p, size_t i, size_t end )
+    {
+        for (;i+8<=end;i+=8)
+        {
+            uint64_t v;
+            memcpy( &v, p+i, 8 );
+            if ((v-ones)&~v&highs)
+                break;
+        }
+        while (i<end && p[i])
+            i++;
+        return i;
+    }
+
+public:
+    xor_compressor( size_t width, size_t height ) : compressor{ width, height } {}
+
+    virtual bool full_screen() const { return true; }
+
+        //  Each byte of data fixes at most 8 pixels
+    virtual size_t min_differences( const frame_diff &diff, size_t budget ) const
+    {
+        if (diff.changed()<=budget*8)
+            return 0;
+        return diff.changed()-budget*8;
+    }
+
+        /// Format: a series of runs, each a skip count and a literal count (1 byte each), followed by the literal
+        /// bytes to xor with the screen. Counts are in bytes, in screen order. Skip and literal counts of 0 end the data
+    virtual std::vector<uint8_t> compress( frame_patch &patch, const framebuffer &current, const framebuffer &target, [[maybe_unused]] const frame_diff &diff, [[maybe_unused]] const word_weights &weights, size_t budget ) const
+    {
+        auto delta = (current^target).raw_data();
+        const uint8_t *p = delta.data();
+        size_t end = delta.size();
+
+        std::vector<uint8_t> data;
+        auto out = std::back_inserter( data );
+
+            //  The patch is written a word at a time
+        size_t word = end;
+        uint32_t changes = 0;
+        uint32_t mask = 0;
+        auto flush = [&]()
+        {
+            if (mask)
+                patch.set_word( word, current.word( word )^changes, mask );
+            changes = mask = 0;
+        };
+
+            //  Room for the end marker
+        size_t room = budget>2?budget-2:0;
+
+        size_t pos = 0;
+        size_t start = next_non_zero( p, 0, end );
+        while (start<end)
+        {
+                //  The literal goes on over short zero spans
+            size_t stop = next_zero( p, start, end );
+            size_t next = next_non_zero( p, stop, end );
+            while (next<end && next-stop<min_skip)
+            {
+                stop = next_zero( p, next, end );
+                next = next_non_zero( p, stop, end );
+            }
+
+                //  Long skips are made of empty literals, and there must be room for a byte of literal after them
+            size_t skip = start-pos;
+            if (data.size()+(skip/max_count)*2+3>room)
+                break;
+            for (;skip>max_count;skip-=max_count)
+            {
+                write1( out, max_count );
+                write1( out, 0 );
+            }
+
+                //  Literals longer than max_count are followed by a null skip
+            while (start<stop && data.size()+3<=room)
+            {
+                size_t len = std::min( { stop-start, max_count, room-data.size()-2 } );
+                write1( out, skip );
+                write1( out, len );
+                for (size_t i=start;i!=start+len;i++)
+                {
+                    write1( out, p[i] );
+                    if (i/4!=word)
+                        flush();
+                    word = i/4;
+                    changes |= (uint32_t)p[i]<<((3-i%4)*8);
+                    mask |= (uint32_t)0xff<<((3-i%4)*8);
+                }
+                start += len;
+                skip = 0;
+            }
+            if (start<stop)
+                break;
+
+            pos = stop;
+            start = next;
+        }
+        flush();
+
+        write1( out, 0 );
+        write1( out, 0 );
+
+        return data;
+    }
 };
 
 #endif
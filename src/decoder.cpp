@@ -0,0 +1,371 @@
+#include "decoder.hpp"
+
+//  ------------------------------------------------------------------
+//  Big endian readers
+//  ------------------------------------------------------------------
+static uint32_t read2( const uint8_t *p )
+{
+    return (p[0]<<8) | p[1];
+}
+
+static uint32_t read4( const uint8_t *p )
+{
+    return (read2( p )<<16) | read2( p+2 );
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x02 : z32
+//  Runs of vertical 32 pixels words, ended by a zero header
+//  Header: count-1 (2 bytes), (offset+1)*4 (2 bytes)
+//  ------------------------------------------------------------------
+size_t decode_z32( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t width32 = fb.W()/32;
+    size_t words = width32*fb.H();
+    size_t i = 0;
+
+    for (;;)
+    {
+        if (i+4>size)
+            throw "Truncated z32 data";
+        uint32_t header = read4( data+i );
+        i += 4;
+        if (!header)
+            return i;
+
+        size_t count = (header>>16)+1;
+        size_t offset = (header&0xffff)/4-1;
+        if (i+count*4>size)
+            throw "Truncated z32 data";
+
+        while (count--)
+        {
+            if (offset>=words)
+                throw "z32 data out of screen";
+            fb.set_word( offset, read4( data+i ) );
+            i += 4;
+            offset += width32;
+        }
+    }
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x03 : invert
+//  The whole screen is inverted, there is no data
+//  ------------------------------------------------------------------
+size_t decode_invert( framebuffer &fb, [[maybe_unused]] const uint8_t *data, [[maybe_unused]] size_t size )
+{
+    fb.invert();
+    return 0;
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x04 : lines
+//  A band of full lines, copied as is
+//  Header: byte count, byte offset from the top of the screen (2 bytes each)
+//  ------------------------------------------------------------------
+size_t decode_lines( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t rowbytes = fb.W()/8;
+
+    if (size<4)
+        throw "Truncated lines data";
+    size_t len = read2( data );
+    size_t offset = read2( data+2 );
+    if (len%rowbytes || offset%rowbytes)
+        throw "Lines data is not made of whole lines";
+    if (offset+len>rowbytes*fb.H())
+        throw "Lines data out of screen";
+    if (4+len>size)
+        throw "Truncated lines data";
+
+    fb.set_lines( offset/rowbytes, len/rowbytes, data+4 );
+    return 4+len;
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x05 : scroll
+//  A band of lines moved vertically and by whole bytes horizontally,
+//  followed by z32 data
+//  Header: first line, line count, vertical move, horizontal move
+//  (2 bytes each, moves are signed)
+//  ------------------------------------------------------------------
+size_t decode_scroll( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    if (size<8)
+        throw "Truncated scroll data";
+
+    int from = read2( data );
+    int count = read2( data+2 );
+    int dy = (int16_t)read2( data+4 );
+    int dx = (int16_t)read2( data+6 );
+
+    if (count)
+    {
+        int H = fb.H();
+        if (from+count>H || from-dy<0 || from+count-dy>H || std::abs( dx )>=(int)fb.W()/8)
+            throw "Scroll data out of screen";
+        fb.scroll_lines( from, count, dy, dx );
+    }
+
+    return 8+decode_z32( fb, data+8, size-8 );
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x06 : z32s
+//  Runs of vertical 32 pixels words, ended by a zero header
+//  Header: offset from the previous run (1 byte), count (1 byte)
+//  A zero count only moves the offset (used for skips of more than 255 words)
+//  ------------------------------------------------------------------
+size_t decode_z32s( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t width32 = fb.W()/32;
+    size_t words = width32*fb.H();
+    size_t offset = 0;
+    size_t i = 0;
+
+    for (;;)
+    {
+        if (i+2>size)
+            throw "Truncated z32s data";
+        uint32_t header = read2( data+i );
+        i += 2;
+        if (!header)
+            return i;
+
+        offset += header>>8;
+        size_t count = header&0xff;
+        if (i+count*4>size)
+            throw "Truncated z32s data";
+
+        size_t o = offset;
+        while (count--)
+        {
+            if (o>=words)
+                throw "z32s data out of screen";
+            fb.set_word( o, read4( data+i ) );
+            i += 4;
+            o += width32;
+        }
+    }
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x07 : tiles
+//  32x8 tiles, sent whole or as a reference to the dictionary of the
+//  tiles sent before, followed by z32 data
+//  Commands (2 bytes): tiles to skip, then a slot, 0xff followed by the
+//  32 bytes of the tile, or 0xfe to only skip (0xfe with no skip ends)
+//  ------------------------------------------------------------------
+size_t decode_tiles( framebuffer &fb, tile_dictionary &dictionary, const uint8_t *data, size_t size )
+{
+    size_t width32 = fb.W()/32;
+    size_t count = width32*(fb.H()/tile_dictionary::TileHeight);
+    size_t cursor = 0;
+    size_t i = 0;
+
+    for (;;)
+    {
+        if (i+2>size)
+            throw "Truncated tiles data";
+        size_t skip = data[i];
+        uint8_t code = data[i+1];
+        i += 2;
+
+        if (code==0xfe)
+        {
+            if (!skip)
+                break;
+            cursor += skip;
+            continue;
+        }
+
+        size_t index = cursor+skip;
+        if (index>=count)
+            throw "Tiles data out of screen";
+        cursor = index+1;
+
+        tile_dictionary::tile t;
+        if (code==0xff)
+        {
+            if (i+tile_dictionary::TileHeight*4>size)
+                throw "Truncated tiles data";
+            for (auto &v:t)
+            {
+                v = read4( data+i );
+                i += 4;
+            }
+            dictionary.insert( t );
+        }
+        else
+        {
+            t = dictionary.at( code );
+            dictionary.use( code );
+        }
+
+        for (size_t y=0;y!=tile_dictionary::TileHeight;y++)
+            fb.set_word( ((index/width32)*tile_dictionary::TileHeight+y)*width32+index%width32, t[y] );
+    }
+
+    return i+decode_z32( fb, data+i, size-i );
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x08 : regions
+//  Rectangles filled in white or black, or inverted, followed by z32 data
+//  Header: number of rectangles (2 bytes)
+//  Rectangle: top, height (2 bytes each), left, width (in 32 pixels
+//  words, 1 byte each), operation (2 bytes, 0: white, 1: black, 2: invert)
+//  ------------------------------------------------------------------
+size_t decode_regions( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t width32 = fb.W()/32;
+
+    if (size<2)
+        throw "Truncated regions data";
+    size_t count = read2( data );
+    size_t i = 2;
+    if (i+count*8>size)
+        throw "Truncated regions data";
+
+    while (count--)
+    {
+        size_t top = read2( data+i );
+        size_t height = read2( data+i+2 );
+        size_t left = data[i+4];
+        size_t width = data[i+5];
+        uint32_t op = read2( data+i+6 );
+        i += 8;
+
+        if (top+height>fb.H() || left+width>width32 || op>2)
+            throw "Regions data out of screen";
+
+        for (size_t y=top;y!=top+height;y++)
+            for (size_t x=left;x!=left+width;x++)
+            {
+                size_t offset = y*width32+x;
+                fb.set_word( offset, op==0?0x00000000:op==1?0xffffffff:~fb.word( offset ) );
+            }
+    }
+
+    return i+decode_z32( fb, data+i, size-i );
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x09 : mlines
+//  Several bands of lines, copied as is
+//  Header: number of bands (2 bytes)
+//  Band: first line, number of lines (2 bytes each), then the lines
+//  ------------------------------------------------------------------
+size_t decode_mlines( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t rowbytes = fb.W()/8;
+
+    if (size<2)
+        throw "Truncated mlines data";
+    size_t count = read2( data );
+    size_t i = 2;
+
+    while (count--)
+    {
+        if (i+4>size)
+            throw "Truncated mlines data";
+        size_t from = read2( data+i );
+        size_t lines = read2( data+i+2 );
+        i += 4;
+        if (from+lines>fb.H())
+            throw "mlines data out of screen";
+        if (i+lines*rowbytes>size)
+            throw "Truncated mlines data";
+        fb.set_lines( from, lines, data+i );
+        i += lines*rowbytes;
+    }
+
+    return i;
+}
+
+//  ------------------------------------------------------------------
+//  Codec 0x0a : xor
+//  Runs of bytes xored with the screen, in screen order
+//  Run: bytes to skip (1 byte), bytes to xor (1 byte), then the bytes
+//  Skip and xor counts of 0 end the data
+//  ------------------------------------------------------------------
+size_t decode_xor( framebuffer &fb, const uint8_t *data, size_t size )
+{
+    size_t total = fb.W()/8*fb.H();
+    size_t pos = 0;
+    size_t i = 0;
+
+    for (;;)
+    {
+        if (i+2>size)
+            throw "Truncated xor data";
+        size_t skip = data[i];
+        size_t count = data[i+1];
+        i += 2;
+        if (!skip && !count)
+            return i;
+
+        pos += skip;
+        if (pos+count>total)
+            throw "xor data out of screen";
+        if (i+count>size)
+            throw "Truncated xor data";
+        fb.xor_bytes( pos, data+i, count );
+        pos += count;
+        i += count;
+    }
+}
+
+//  ------------------------------------------------------------------
+//  Whole frames
+//  ------------------------------------------------------------------
+void flim_decoder::decode( const uint8_t *video, size_t size )
+{
+    if (size<4)
+        throw "Truncated video header";
+
+    const uint8_t *data = video+4;
+    size -= 4;
+
+    size_t used = 0;
+    switch (video[3])
+    {
+        case 0x00:      //  null
+        case 0x01:      //  z16, ignored by the player
+            used = size;
+            break;
+        case 0x02:
+            used = decode_z32( screen_, data, size );
+            break;
+        case 0x03:
+            used = decode_invert( screen_, data, size );
+            break;
+        case 0x04:
+            used = decode_lines( screen_, data, size );
+            break;
+        case 0x05:
+            used = decode_scroll( screen_, data, size );
+            break;
+        case 0x06:
+            used = decode_z32s( screen_, data, size );
+            break;
+        case 0x07:
+            used = decode_tiles( screen_, dictionary_, data, size );
+            break;
+        case 0x08:
+            used = decode_regions( screen_, data, size );
+            break;
+        case 0x09:
+            used = decode_mlines( screen_, data, size );
+            break;
+        case 0x0a:
+            used = decode_xor( screen_, data, size );
+            break;
+        default:
+            throw "Unknown codec";
+    }
+
+    if (used!=size)
+        throw "Trailing bytes after codec data";
+}
@@ -0,0 +1,63 @@
+#ifndef DECODER_INCLUDED__
+#define DECODER_INCLUDED__
+
+#include <cstdint>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "tiledictionary.hpp"
+
+//  ------------------------------------------------------------------
+//  Host side reference decoders
+//  They do on a framebuffer what the player does on screen, so the
+//  encoder output can be checked without a Mac
+//  Malformed data throws
+//  ------------------------------------------------------------------
+
+//  Applies z32 data to fb, returns the number of bytes read (including the end marker)
+size_t decode_z32( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies z32s data to fb, returns the number of bytes read (including the end marker)
+size_t decode_z32s( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies tiles data to fb, returns the number of bytes read
+//  dictionary is the state kept from the previous tiles frames of the flim
+size_t decode_tiles( framebuffer &fb, tile_dictionary &dictionary, const uint8_t *data, size_t size );
+
+//  Applies regions data to fb, returns the number of bytes read
+size_t decode_regions( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies mlines data to fb, returns the number of bytes read
+size_t decode_mlines( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies xor data to fb, returns the number of bytes read (including the end marker)
+size_t decode_xor( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Inverts fb, there is no data, returns 0
+size_t decode_invert( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies lines data to fb, returns the number of bytes read
+size_t decode_lines( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Applies scroll data to fb, returns the number of bytes read
+size_t decode_scroll( framebuffer &fb, const uint8_t *data, size_t size );
+
+//  Decodes the successive frames of a flim, keeping what the player keeps
+//  between them: the screen and the tiles dictionary
+//  The z16 codec (0x01) is ignored, like the player does
+class flim_decoder
+{
+    framebuffer screen_;
+    tile_dictionary dictionary_;
+
+public:
+    flim_decoder( const framebuffer &initial ) : screen_{ initial } {}
+
+        //  video is the video part of a frame: 4 bytes header ending with the codec signature, then the codec data
+    void decode( const uint8_t *video, size_t size );
+    void decode( const std::vector<uint8_t> &video ) { decode( video.data(), video.size() ); }
+
+    const framebuffer &screen() const { return screen_; }
+};
+
+#endif
@@ -0,0 +1,490 @@
+/**
+ * The flim2video tool converts flims back into movies and images, using the reference decoders
+ * It is a fast way to review encodes, as it does not need the source nor a new encode (flimmaker --mp4)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <set>
+#include <array>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "framebuffer.hpp"
+#include "decoder.hpp"
+#include "image.hpp"
+#include "writer.hpp"
+
+// True if the global '-g' option was set
+bool sDebug = false;
+
+static uint32_t read2( const uint8_t *p ) { return (p[0]<<8) | p[1]; }
+static uint32_t read4( const uint8_t *p ) { return (read2( p )<<16) | read2( p+2 ); }
+
+/**
+ * A flim file, memory mapped
+ * Layout (as written by flimencoder):
+ *   1022 bytes of comment, 2 bytes of checksum
+ *   header: version (2), entry count (2), then entries of type (2), offset (4), size (4)
+ *   the entries data, offsets counting from the end of the header:
+ *     0x00 info: width (2), height (2), silent (2), frame count (4, advisory), tick count (4), byterate (2), codecs (4, bitmap)
+ *     0x01 movie: the frames
+ *     0x02 toc: the size of each frame (2 bytes each)
+ *     0x03 poster
+ */
+class flim_file
+{
+public:
+    struct frame
+    {
+        size_t ticks;
+        const uint8_t *audio;       //  ticks*sound_frame_t::size bytes, nullptr for silent flims
+        const uint8_t *video;       //  4 bytes header, with the codec signature, then the codec data
+        size_t video_size;
+    };
+
+private:
+    int fd_ = -1;
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+
+    size_t W_ = 0;
+    size_t H_ = 0;
+    bool silent_ = false;
+    std::vector<frame> frames_;
+
+        //  Pointer to the size bytes of an entry, after checking that they are in the file
+    const uint8_t *at( size_t offset, size_t size ) const
+    {
+        if (offset>size_ || size>size_-offset)
+            throw "Truncated flim";
+        return data_+offset;
+    }
+
+        //  Walks the TOC to locate every frame of the movie
+        //  The TOC has an entry for each frame, while the frame count of the info is the number
+        //  of source images when the encoder does not group them, so it is not used
+    void read_frames( size_t movie_offset, size_t movie_size, size_t toc_offset, size_t toc_size )
+    {
+        if (toc_size%2)
+            throw "Bad TOC size";
+        size_t frame_count = toc_size/2;
+
+        const uint8_t *toc = at( toc_offset, toc_size );
+        size_t offset = movie_offset;
+        size_t movie_end = movie_offset+movie_size;
+
+        frames_.reserve( frame_count );
+        for (size_t i=0;i!=frame_count;i++)
+        {
+            size_t frame_size = read2( toc+i*2 );
+            if (offset+frame_size>movie_end)
+                throw "Frame goes past the end of the movie";
+            const uint8_t *p = at( offset, frame_size );
+            const uint8_t *end = p+frame_size;
+
+            frame f;
+            if (frame_size<4)
+                throw "Truncated frame";
+            f.ticks = read2( p );
+            size_t sound_size = read2( p+2 );
+            p += 4;
+            f.audio = nullptr;
+            if (sound_size!=2)
+            {
+                if (sound_size!=f.ticks*sound_frame_t::size+8 || p+6+f.ticks*sound_frame_t::size>end)
+                    throw "Bad sound size";
+                f.audio = p+6;      //  After ffMode and rate
+                p += sound_size-2;
+            }
+            if (p+2>end)
+                throw "Truncated frame";
+            size_t video_size = read2( p );
+            if (video_size<2 || p+video_size!=end)
+                throw "Video size does not match the TOC";
+            f.video = p+2;
+            f.video_size = video_size-2;
+
+            frames_.push_back( f );
+            offset += frame_size;
+        }
+    }
+
+public:
+    flim_file( const std::string &path )
+    {
+        fd_ = open( path.c_str(), O_RDONLY );
+        if (fd_<0)
+            throw "Cannot open flim";
+        struct stat st;
+        if (fstat( fd_, &st )<0 || st.st_size<1024+4)
+        {
+            close( fd_ );
+            throw "Not a flim";
+        }
+        size_ = st.st_size;
+        void *p = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0 );
+        if (p==MAP_FAILED)
+        {
+            close( fd_ );
+            throw "Cannot map flim";
+        }
+        data_ = (const uint8_t *)p;
+            //  Frames are read once, in order
+        madvise( p, size_, MADV_SEQUENTIAL );
+
+        try
+        {
+            const uint8_t *header = at( 1024, 4 );
+            if (read2( header )!=1)
+                throw "Unsupported flim version";
+            size_t entry_count = read2( header+2 );
+            const uint8_t *entries = at( 1024+4, entry_count*10 );
+            size_t base = 1024+4+entry_count*10;
+
+            size_t info_offset = 0, info_size = 0;
+            size_t movie_offset = 0, movie_size = 0;
+            size_t toc_offset = 0, toc_size = 0;
+            for (size_t i=0;i!=entry_count;i++)
+            {
+                const uint8_t *e = entries+i*10;
+                size_t offset = base+read4( e+2 );
+                size_t size = read4( e+6 );
+                switch (read2( e ))
+                {
+                    case 0x00: info_offset = offset; info_size = size; break;
+                    case 0x01: movie_offset = offset; movie_size = size; break;
+                    case 0x02: toc_offset = offset; toc_size = size; break;
+                }
+            }
+
+            if (info_size<16)
+                throw "Missing flim info";
+            const uint8_t *info = at( info_offset, info_size );
+            W_ = read2( info );
+            H_ = read2( info+2 );
+            silent_ = read2( info+4 )==1;
+            if (!W_ || W_%32 || !H_)
+                throw "Unsupported flim size";
+
+            at( movie_offset, movie_size );
+            read_frames( movie_offset, movie_size, toc_offset, toc_size );
+        }
+        catch (const char *)
+        {
+            munmap( (void *)data_, size_ );
+            close( fd_ );
+            throw;
+        }
+    }
+
+    ~flim_file()
+    {
+        munmap( (void *)data_, size_ );
+        close( fd_ );
+    }
+
+    flim_file( const flim_file & ) = delete;
+    flim_file &operator=( const flim_file & ) = delete;
+
+    size_t W() const { return W_; }
+    size_t H() const { return H_; }
+    bool silent() const { return silent_; }
+    const std::vector<frame> &frames() const { return frames_; }
+};
+
+//  ------------------------------------------------------------------
+//  PNG output of a 1 bit screen
+//  Grey 1 bit, with stored (uncompressed) deflate blocks, so no zlib is needed
+//  ------------------------------------------------------------------
+static uint32_t crc32( uint32_t crc, const uint8_t *p, size_t len )
+{
+    static const auto table = []{
+        std::array<uint32_t,256> t;
+        for (uint32_t n=0;n!=256;n++)
+        {
+            uint32_t c = n;
+            for (int k=0;k!=8;k++)
+                c = (c&1)?0xedb88320^(c>>1):c>>1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc ^= 0xffffffff;
+    while (len--)
+        crc = table[(crc^*p++)&0xff]^(crc>>8);
+    return crc^0xffffffff;
+}
+
+static void write_png( const char *file, const framebuffer &fb )
+{
+    size_t rowbytes = fb.W()/8;
+
+        //  Filter byte then the line, inverted as png greys are 0 for black
+    std::vector<uint8_t> raw;
+    raw.reserve( (rowbytes+1)*fb.H() );
+    for (size_t y=0;y!=fb.H();y++)
+    {
+        raw.push_back( 0 );
+        const uint8_t *line = fb.line( y );
+        for (size_t x=0;x!=rowbytes;x++)
+            raw.push_back( line[x]^0xff );
+    }
+
+    std::vector<uint8_t> z = { 0x78, 0x01 };
+    for (size_t i=0;i<raw.size();i+=65535)
+    {
+        size_t len = std::min( raw.size()-i, (size_t)65535 );
+        z.push_back( i+len==raw.size() );
+        z.push_back( len&0xff ); z.push_back( len>>8 );
+        z.push_back( ~len&0xff ); z.push_back( (~len>>8)&0xff );
+        z.insert( std::end(z), std::begin(raw)+i, std::begin(raw)+i+len );
+    }
+    uint32_t a = 1, b = 0;
+    for (auto v:raw)
+    {
+        a = (a+v)%65521;
+        b = (b+a)%65521;
+    }
+    auto adler = from_value<uint32_t>( (b<<16)|a );
+    z.insert( std::end(z), std::begin(adler), std::end(adler) );
+
+    FILE *f = fopen( file, "wb" );
+    if (!f)
+        throw "Cannot create image file";
+
+    auto chunk = [f]( const char *type, const std::vector<uint8_t> &data ) {
+        auto size = from_value<uint32_t>( data.size() );
+        std::vector<uint8_t> c( std::begin(size), std::end(size) );
+        c.insert( std::end(c), type, type+4 );
+        c.insert( std::end(c), std::begin(data), std::end(data) );
+        auto crc = from_value<uint32_t>( crc32( 0, c.data()+4, c.size()-4 ) );
+        c.insert( std::end(c), std::begin(crc), std::end(crc) );
+        fwrite( c.data(), 1, c.size(), f );
+    };
+
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite( signature, 1, sizeof(signature), f );
+    auto w = from_value<uint32_t>( fb.W() );
+    auto h = from_value<uint32_t>( fb.H() );
+        //  Size, then 1 bit grey, deflate, no filter, no interlace
+    chunk( "IHDR", { w[0], w[1], w[2], w[3], h[0], h[1], h[2], h[3], 1, 0, 0, 0, 0 } );
+    chunk( "IDAT", z );
+    chunk( "IEND", {} );
+    fclose( f );
+}
+
+//  ------------------------------------------------------------------
+//  Conversion of a single flim
+//  ------------------------------------------------------------------
+struct conversion_options
+{
+    std::string video_extension = "mp4";    //  Extension of the generated movie, "none" for no movie
+    std::string image_format = "png";       //  png or pgm
+    std::vector<size_t> frames;             //  Frames to dump as images
+    std::vector<double> timestamps;         //  Frames to dump as images, by time in seconds
+};
+
+static std::string without_extension( const std::string &path )
+{
+    auto dot = path.find_last_of( '.' );
+    auto slash = path.find_last_of( '/' );
+    if (dot==std::string::npos || (slash!=std::string::npos && dot<slash))
+        return path;
+    return path.substr( 0, dot );
+}
+
+//  Returns the number of decoded frames
+static size_t convert( const std::string &path, const conversion_options &options )
+{
+    flim_file flim( path );
+    auto &frames = flim.frames();
+    std::string base = without_extension( path );
+
+        //  Frames to dump, the ones given by time are the ones on screen at that tick
+    std::set<size_t> dumps( std::begin(options.frames), std::end(options.frames) );
+    for (auto t:options.timestamps)
+    {
+        size_t tick = t*60+.5;
+        size_t start = 0;
+        for (size_t i=0;i!=frames.size();i++)
+        {
+            start += frames[i].ticks;
+            if (start>tick || i==frames.size()-1)
+            {
+                dumps.insert( i );
+                break;
+            }
+        }
+    }
+
+    std::unique_ptr<output_writer> writer;
+    if (options.video_extension!="none")
+        writer = make_ffmpeg_writer( base+"."+options.video_extension, flim.W(), flim.H() );
+
+        //  The player starts from a black screen, as the encoder does
+    framebuffer initial( flim.W(), flim.H() );
+    initial.fill( 0xff );
+    flim_decoder decoder( initial );
+
+    sound_frame_t silence;
+    sound_frame_t sound;
+
+    for (size_t i=0;i!=frames.size();i++)
+    {
+        auto &f = frames[i];
+        decoder.decode( f.video, f.video_size );
+
+        if (writer)
+            for (size_t t=0;t!=f.ticks;t++)
+            {
+                if (f.audio)
+                {
+                    const uint8_t *samples = f.audio+t*sound_frame_t::size;
+                    for (size_t s=0;s!=sound_frame_t::size;s++)
+                        sound.at( s ) = samples[s];
+                }
+                writer->write_screen( decoder.screen(), f.audio?sound:silence );
+            }
+
+        if (dumps.count( i ))
+        {
+            char buffer[1024];
+            snprintf( buffer, sizeof(buffer), "%s-%06zu.%s", base.c_str(), i, options.image_format.c_str() );
+            if (options.image_format=="png")
+                write_png( buffer, decoder.screen() );
+            else
+                write_image( buffer, decoder.screen().as_image() );
+        }
+    }
+
+    return frames.size();
+}
+
+void usage( const std::string name )
+{
+    std::cerr << "Usage\n";
+    std::cerr << name << " FLIM [FLIM ...] [OPTIONS ...]\n";
+    std::cerr << "  Decodes each FLIM into a movie of the same name, and/or dumps some of its frames as images\n";
+    std::cerr << "\n  Options:\n";
+    std::cerr << "    --video EXTENSION           : movie format, from its extension (default 'mp4'). 'none' to only dump images\n";
+    std::cerr << "    --frame INDEX               : dumps frame INDEX as FLIM-INDEX.png (can be repeated)\n";
+    std::cerr << "    --at SECONDS                : dumps the frame on screen at that time (can be repeated)\n";
+    std::cerr << "    --image-format FORMAT       : 'png' (default) or 'pgm'\n";
+    std::cerr << "    --jobs N                    : number of flims converted in parallel (default: number of cores)\n";
+    std::cerr << "    --debug BOOLEAN             : enables various debug options\n";
+}
+
+int main( int argc, char **argv )
+{
+    const std::string cmd_name{ argv[0] };
+    std::vector<std::string> inputs;
+    conversion_options options;
+    size_t jobs = std::max( std::thread::hardware_concurrency(), 1u );
+
+    argc--;
+    argv++;
+
+    while (argc)
+    {
+        if (!strcmp( *argv, "--help" ))
+        {
+            usage( cmd_name );
+            ::exit( EXIT_SUCCESS );
+        }
+
+        if (strncmp( *argv, "--", 2 ))
+            inputs.push_back( *argv );
+        else if (argc==1)
+        {
+            std::cerr << "Missing value for option '" << *argv << "'\n";
+            ::exit( EXIT_FAILURE );
+        }
+        else if (!strcmp( *argv, "--video" )) {
+            argc--;
+            argv++;
+            options.video_extension = *argv;
+        } else if (!strcmp( *argv, "--frame" )) {
+            argc--;
+            argv++;
+            options.frames.push_back( atol( *argv ) );
+        } else if (!strcmp( *argv, "--at" )) {
+            argc--;
+            argv++;
+            options.timestamps.push_back( atof( *argv ) );
+        } else if (!strcmp( *argv, "--image-format" )) {
+            argc--;
+            argv++;
+            options.image_format = *argv;
+            if (options.image_format!="png" && options.image_format!="pgm")
+            {
+                std::cerr << "Unknown image format '" << *argv << "'\n";
+                ::exit( EXIT_FAILURE );
+            }
+        } else if (!strcmp( *argv, "--jobs" )) {
+            argc--;
+            argv++;
+            jobs = std::max( atoi( *argv ), 1 );
+        } else if (!strcmp( *argv, "--debug" )) {
+            argc--;
+            argv++;
+            sDebug = !strcmp( *argv, "true" );
+        } else {
+            std::cerr << "Unknown option '" << *argv << "'\n";
+            usage( cmd_name );
+            ::exit( EXIT_FAILURE );
+        }
+
+        argc--;
+        argv++;
+    }
+
+    if (inputs.empty())
+    {
+        usage( cmd_name );
+        ::exit( EXIT_FAILURE );
+    }
+
+        //  Each worker takes the next flim, until there is none left
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> failed = false;
+    std::mutex log;
+    auto worker = [&]() {
+        for (size_t n;(n = next++)<inputs.size();)
+        {
+            auto start = std::chrono::steady_clock::now();
+            try
+            {
+                size_t count = convert( inputs[n], options );
+                double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now()-start ).count();
+                std::lock_guard<std::mutex> lock( log );
+                std::clog << inputs[n] << ": " << count << " frames in " << seconds << " s (" << count/std::max( seconds, 1e-6 ) << " frames/s)\n";
+            }
+            catch (const char *error)
+            {
+                failed = true;
+                std::lock_guard<std::mutex> lock( log );
+                std::cerr << "**** ERROR: " << inputs[n] << ": [" << error << "]\n";
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i=1;i<std::min( jobs, inputs.size() );i++)
+        threads.emplace_back( worker );
+    worker();
+    for (auto &t:threads)
+        t.join();
+
+    return failed?EXIT_FAILURE:EXIT_SUCCESS;
+}
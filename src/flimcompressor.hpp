@@ -12,6 +12,9 @@
 #include <bitset>
 #include <algorithm>
 #include <memory>
+#include <deque>
+#include <map>
+#include <cmath>
 
 #include "reader.hpp"
 #include "subtitles.hpp"
@@ -39,6 +42,14 @@ public:
 
         framebuffer result;         //  What we actually draw
 
+            //  Encoding statistics
+        std::string codec;          //  Name of the codec used
+        size_t budget = 0;          //  Video budget that was available
+        long bucket = 0;            //  Rate control bucket level after this frame
+        double quality = 0;         //  Proximity of result to source
+        bool cut = false;           //  First frame of a new scene
+        bool duplicate = false;     //  First frame of an image identical to the previous one
+
         //  #### passing silent is inelegant: we should not generate audio data when silenced
         size_t get_size( bool silent ) { return video.size()+silent*audio.size(); }
 
@@ -69,6 +80,93 @@ public:
         const float error_bleed_;
         const bool error_bidi_;
         const std::string watermark_;       //  Unsure if this should be here or higher
+        const bool importance_;             //  Compute the importance of each word of the screen
+        const double tile_threshold_;       //  Tiles whose source changed less than this are not dithered again (0: dither everything)
+        const bool motion_;                 //  Move the previous dithered image along the source motion
+    };
+
+    struct EncodingParameters
+    {
+        const std::vector<codec_spec> codecs_;  //  Codecs that compete for each frame
+        const size_t byterate_;             //  Average bytes of video per tick
+        const bool group_;                  //  One frame per input image, over all its ticks (false: one frame per tick)
+        const size_t vbr_depth_;            //  Depth of the rate control bucket, in bytes (0: constant rate)
+        const double drop_threshold_;       //  Images whose update fixes less than this part of the differences are dropped
+        const size_t lookahead_;            //  Number of future images looked at when encoding one
+        const double age_half_life_;        //  Ticks after which the priority of a wrong word doubles (0: no aging)
+    };
+
+    /// Detects scene changes on a small thumbnail of the luma
+    /// A cut is a frame where both the pixels (SAD) and the luma distribution (histogram) changed a lot,
+    /// so fast motion (high SAD, same histogram) and fades (slow changes) are not taken as cuts
+    class CutDetector
+    {
+        static const size_t TW = 64;            //  Thumbnail size
+        static const size_t TH = 43;
+        static const size_t Bins = 16;          //  Histogram bins
+        static constexpr float SadThreshold = 0.12;     //  Mean absolute difference of the thumbnails
+        static constexpr float HistThreshold = 0.25;    //  Part of the pixels that changed bin
+
+        image thumbnail_;
+        std::array<size_t,Bins> histogram_;
+        bool first_ = true;
+
+            //  Box filtered downscale, so the detector is not fooled by noise or dithering patterns
+        static image make_thumbnail( const image &img )
+        {
+            image res( TW, TH );
+            for (size_t y=0;y!=TH;y++)
+                for (size_t x=0;x!=TW;x++)
+                {
+                    size_t x0 = x*img.W()/TW, x1 = std::max( x0+1, (x+1)*img.W()/TW );
+                    size_t y0 = y*img.H()/TH, y1 = std::max( y0+1, (y+1)*img.H()/TH );
+                    float sum = 0;
+                    for (size_t sy=y0;sy!=y1;sy++)
+                        for (size_t sx=x0;sx!=x1;sx++)
+                            sum += img.at( sx, sy );
+                    res.at( x, y ) = sum/((x1-x0)*(y1-y0));
+                }
+            return res;
+        }
+
+        static std::array<size_t,Bins> make_histogram( const image &img )
+        {
+            std::array<size_t,Bins> res{};
+            for (auto v:img.image_)
+                res[std::clamp( (int)(v*Bins), 0, (int)Bins-1 )]++;
+            return res;
+        }
+
+    public:
+        CutDetector() : thumbnail_{ TW, TH } {}
+
+            /// Returns true if img starts a new scene
+        bool detect( const image &img )
+        {
+            image thumbnail = make_thumbnail( img );
+            auto histogram = make_histogram( thumbnail );
+
+            bool cut = false;
+            if (!first_)
+            {
+                float sad = 0;
+                for (size_t i=0;i!=thumbnail.image_.size();i++)
+                    sad += fabs( thumbnail.image_[i]-thumbnail_.image_[i] );
+                sad /= thumbnail.image_.size();
+
+                size_t moved = 0;
+                for (size_t i=0;i!=Bins;i++)
+                    moved += histogram[i]>histogram_[i]?histogram[i]-histogram_[i]:histogram_[i]-histogram[i];
+                float hist = moved/2.0/(TW*TH);
+
+                cut = sad>SadThreshold && hist>HistThreshold;
+            }
+
+            first_ = false;
+            thumbnail_ = thumbnail;
+            histogram_ = histogram;
+            return cut;
+        }
     };
 
     /// This will dither a series of images, using the previous ones to minimize artifacts
@@ -82,36 +180,220 @@ public:
 
         const DitheringParameters dp_;
 
+        CutDetector cut_detector_;
+        bool cut_ = false;          //  The last dithered image starts a new scene
+
+        filter_state filter_state_; //  Memory of the temporal filters
+        size_t warped_ = 0;         //  Number of images dithered over a motion compensated previous image
+
+        word_weights importance_;   //  Importance of each 32 pixels word of the last image (empty if not computed)
+
+        static const size_t TileSize = 32;
+        image reference_image_;     //  Filtered source of each tile, when it was last dithered
+        image error_image_;         //  Error diffused by each pixel, when it was last dithered
+        bool has_reference_ = false;
+        size_t tiles_ = 0;          //  Number of dithered tiles
+        size_t kept_tiles_ = 0;     //  Number of tiles reused from the previous image
+
+        //  Tiles of the filtered image that are close enough to the one that was last dithered
+        //  The reference is updated for the others
+        std::vector<bool> unchanged_tiles( const image &filtered )
+        {
+            size_t tiles_width = (W_+TileSize-1)/TileSize;
+            size_t tiles_height = (H_+TileSize-1)/TileSize;
+            std::vector<bool> keep( tiles_width*tiles_height );
+            std::vector<float> difference( tiles_width*tiles_height );
+
+            for (size_t y=0;y!=H_;y++)
+            {
+                const float *p = filtered.image_.data()+y*W_;
+                const float *q = reference_image_.image_.data()+y*W_;
+                float *d = difference.data()+y/TileSize*tiles_width;
+                for (size_t x=0;x!=W_;x++)
+                    d[x/TileSize] += std::abs( p[x]-q[x] );
+            }
+
+            for (size_t t=0;t!=keep.size();t++)
+            {
+                size_t w = std::min( TileSize, W_-t%tiles_width*TileSize );
+                size_t h = std::min( TileSize, H_-t/tiles_width*TileSize );
+                keep[t] = difference[t]/(w*h)<dp_.tile_threshold_;
+            }
+
+            for (size_t y=0;y!=H_;y++)
+                for (size_t x=0;x!=W_;x++)
+                    if (!keep[y/TileSize*tiles_width+x/TileSize])
+                        reference_image_.at( x, y ) = filtered.at( x, y );
+
+            tiles_ += keep.size();
+            kept_tiles_ += std::count( std::begin(keep), std::end(keep), true );
+            return keep;
+        }
+
+        static constexpr float BarWeight = 0.1;         //  Black bars never change, but are never looked at either
+        static constexpr float SubtitleWeight = 2;      //  Subtitles must be readable
+
+        //  Weight of each 32 pixels word of the image: details and edges matter more than flat areas,
+        //  the centre of the screen more than the borders, and the black bars nothing at all
+        //  The loops are kept simple and branchless, so the compiler vectorizes them
+        void compute_importance( const image &img, size_t x0, size_t y0, size_t x1, size_t y1 )
+        {
+            size_t words = W_/32;
+            importance_.resize( words*H_ );
+            std::vector<float> gradient( W_ );
+
+            for (size_t y=0;y!=H_;y++)
+            {
+                const float *p = img.image_.data()+y*W_;
+                const float *q = img.image_.data()+std::min( y+1, H_-1 )*W_;
+                for (size_t x=0;x!=W_-1;x++)
+                    gradient[x] = std::abs( p[x+1]-p[x] )+std::abs( q[x]-p[x] );
+                gradient[W_-1] = std::abs( q[W_-1]-p[W_-1] );
+
+                float dy = (y+0.5f)/H_-0.5f;
+                for (size_t w=0;w!=words;w++)
+                {
+                    float sum = 0;
+                    for (size_t i=0;i!=32;i++)
+                        sum += gradient[w*32+i];
+                    float contrast = std::min( sum/8, 1.0f );   //  Average gradient of 0.25 is a strong edge
+                    float dx = (w+0.5f)/words-0.5f;
+                    float centre = 1-(dx*dx+dy*dy);             //  From 1 at the centre to 0.5 in the corners
+                    importance_[y*words+w] = (0.5f+1.5f*contrast)*centre;
+                }
+            }
+
+            //  Words entirely in the black bars
+            for (size_t y=0;y!=H_;y++)
+                for (size_t w=0;w!=words;w++)
+                    if (y<y0 || y>=y1 || (w+1)*32<=x0 || w*32>=x1)
+                        importance_[y*words+w] = BarWeight;
+        }
+
     public:
         Ditherer( const image inital_image, const DitheringParameters dp ) :
                 W_{ inital_image.W() },
                 H_{ inital_image.H() },
                 dithered_image_{ W_, H_ },
-                dp_{dp}
+                dp_{dp},
+                reference_image_{ W_, H_ },
+                error_image_{ W_, H_ }
         {
             //  Initial dithered image is black, we dither to whatever the initial image is
             dither( inital_image );
+            filter_state_ = {};
         }
 
         size_t W() const { return W_; }
         size_t H() const { return H_; }
 
+        //  Part of the screen covered by the source image img, the rest is black bars (see copy_scale)
+        //  Without bars, the source image is larger than the screen
+        void content_rect( const image &img, double &x0, double &y0, double &x1, double &y1 ) const
+        {
+            x0 = 0, y0 = 0, x1 = W_, y1 = H_;
+            if (img.W()==W_ && img.H()==H_)
+                return;
+            double scalex = img.W()/(double)W_;
+            double scaley = img.H()/(double)H_;
+            double scale = dp_.bars_?std::max( scalex, scaley ):std::min( scalex, scaley );
+            x0 = W_/2-(img.W()/2)/scale;
+            y0 = H_/2-(img.H()/2)/scale;
+            x1 = W_/2+(img.W()-img.W()/2)/scale;
+            y1 = H_/2+(img.H()-img.H()/2)/scale;
+        }
+
+        //  The displacement of most of the content, in screen pixels, from the block motion of the source
+        //  It is only used if it is whole bytes horizontally (whole lines vertically always are), as
+        //  it is the move that the scroll codec can replay, so the dither pattern must move exactly that way
+        bool dominant_motion( const motion_field &motion, double cw, double ch, int &dx, int &dy ) const
+        {
+            std::map<std::pair<long,long>,float> votes;
+            for (auto &mv:motion)
+                votes[{ std::lround( mv.dx*cw ), std::lround( mv.dy*ch ) }] += mv.w*mv.h;
+
+            auto best = std::max_element( std::begin(votes), std::end(votes), []( auto &a, auto &b ) { return a.second<b.second; } );
+            if (best==std::end(votes) || best->second<0.5)
+                return false;
+
+            dx = best->first.first;
+            dy = best->first.second;
+            return (dx || dy) && dx%8==0;
+        }
+
+        //  Moves the content part of img by dx, dy pixels (the uncovered part stays as it was)
+        void shift( image &img, int dx, int dy, double x0, double y0, double x1, double y1 ) const
+        {
+            int bx0 = std::max( 0L, std::lround( x0 ) );
+            int by0 = std::max( 0L, std::lround( y0 ) );
+            int bx1 = std::min( (long)W_, std::lround( x1 ) );
+            int by1 = std::min( (long)H_, std::lround( y1 ) );
+            image src = img;
+            for (int y=std::max( by0, by0+dy );y<std::min( by1, by1+dy );y++)
+                for (int x=std::max( bx0, bx0+dx );x<std::min( bx1, bx1+dx );x++)
+                    img.at( x, y ) = src.at( x-dx, y-dy );
+        }
+
         /// Dither the image according to the parameters
-        /// Passed
-        void dither( const image &img )
+        /// The motion of the source since the previous image is optional
+        void dither( const image &img, const motion_field &motion = {} )
         {
             image resized_image( W_, H_ );   //  note: was 512x342
             copy( resized_image, img, dp_.bars_ );
 
+            double cx0, cy0, cx1, cy1;
+            content_rect( img, cx0, cy0, cx1, cy1 );
+
+            if (dp_.importance_)
+                compute_importance( resized_image, std::max( 0.0, cx0 ), std::max( 0.0, cy0 ), std::min( (double)W_, cx1 ), std::min( (double)H_, cy1 ) );
+
+            //  On a new scene, the previous images must not bias the filters or the dithering
+            cut_ = cut_detector_.detect( resized_image );
+            if (cut_)
+                filter_state_ = {};
+
             //  We filter the image of the "right size", for things like corners, etc...
-            image filtered_image = filter( resized_image, dp_.filters_.c_str() );
+            image filtered_image = filter( resized_image, dp_.filters_.c_str(), &filter_state_ );
+
+            //  On a pan, the previous dithering moves with the content, and so do the source and error
+            //  that the tiles were dithered with, so moved tiles are kept with their moved pattern
+            //  Without kept tiles, the error diffusion does not give the same pattern again, so nothing is moved
+            image previous = dithered_image_;
+            int dx, dy;
+            if (cut_)
+                fill( previous );
+            else if (dp_.motion_ && dp_.tile_threshold_>0 && dominant_motion( motion, cx1-cx0, cy1-cy0, dx, dy ))
+            {
+                shift( previous, dx, dy, cx0, cy0, cx1, cy1 );
+                shift( reference_image_, dx, dy, cx0, cy0, cx1, cy1 );
+                shift( error_image_, dx, dy, cx0, cy0, cx1, cy1 );
+                warped_++;
+            }
+
+            //  Static parts of the source keep their dithering, so error propagation does not make them flicker
+            std::vector<bool> keep;
+            if (dp_.tile_threshold_>0)
+            {
+                if (has_reference_ && !cut_)
+                    keep = unchanged_tiles( filtered_image );
+                else
+                    reference_image_ = filtered_image;
+                has_reference_ = true;
+            }
 
             image dithered_image( W_, H_ ); //  The extract_video_frame dithered image
 
             if (dp_.dither_==image::error_diffusion)
-                error_diffusion( dithered_image, filtered_image, dithered_image_, dp_.stability_, *get_error_diffusion_by_name( dp_.error_algorithm_ ), dp_.error_bleed_, dp_.error_bidi_ );
+                error_diffusion( dithered_image, filtered_image, previous, dp_.stability_, *get_error_diffusion_by_name( dp_.error_algorithm_ ), dp_.error_bleed_, dp_.error_bidi_, keep, TileSize, &error_image_ );
             else if (dp_.dither_==image::ordered)
-                ordered_dither( dithered_image, filtered_image, dithered_image_ );
+            {
+                ordered_dither( dithered_image, filtered_image, previous );
+                if (!keep.empty())
+                    for (size_t y=0;y!=H_;y++)
+                        for (size_t x=0;x!=W_;x++)
+                            if (keep[y/TileSize*((W_+TileSize-1)/TileSize)+x/TileSize])
+                                dithered_image.at( x, y ) = previous.at( x, y );
+            }
             else
                 throw "Unknown dithering option";
 
@@ -134,6 +416,28 @@ public:
         {
             return dithered_image_;
         }
+
+        //  True if the current image starts a new scene
+        bool cut() const { return cut_; }
+
+        size_t warped() const { return warped_; }
+
+        //  Proportion of the tiles that were not dithered again
+        double kept_tiles() const { return tiles_?kept_tiles_/(double)tiles_:0; }
+
+        //  Importance of each word of the current image, empty if not computed
+        const word_weights &importance() const { return importance_; }
+
+        //  The words where the subtitle was burned in dest must be readable
+        void mark_subtitle( word_weights &weights, const image &dest ) const
+        {
+            if (weights.empty())
+                return;
+            for (size_t y=0;y!=H_;y++)
+                for (size_t x=0;x!=W_;x++)
+                    if (dest.at( x, y )!=dithered_image_.at( x, y ))
+                        weights[y*(W_/32)+x/32] = SubtitleWeight;
+        }
     };
 
     class SubtitleBurner
@@ -148,7 +452,8 @@ public:
         {}
 
         //  Burn the subtitle for time into the image;
-        void burn_into( image& img, double time )
+        //  Returns true if a subtitle was burned
+        bool burn_into( image& img, double time )
         {
             if (subtitles_.size()>0)
             {
@@ -158,6 +463,7 @@ public:
                     if (time<subtitles_.front().stop)
                     {
                         ::burn_subtitle( img, subtitles_.front().text.front() );   //  #### zero line subtitles will crash
+                        return true;
                     }
                     else
                     {
@@ -165,14 +471,78 @@ public:
                     }
                 }
             }
+            return false;
         }
     };
 
+    /// Token bucket rate control
+    /// Every tick adds byterate bytes to the bucket, and every frame takes out the video bytes it used.
+    /// The bucket holds at most depth bytes on top of the current ticks, so over any window the player
+    /// never reads more than byterate bytes per tick plus depth. Static scenes bank their unused
+    /// allowance that busy scenes can later spend.
+    /// A depth of zero is the historical constant byterate per tick.
+    class RateController
+    {
+        size_t byterate_;
+        size_t depth_;
+        long level_ = 0;            //  Bytes available (negative if a codec went over its budget)
+        size_t carry_ = 0;          //  Budget of dropped frames, handed to the next kept one (constant rate only)
+
+    public:
+        RateController( size_t byterate, size_t depth ) : byterate_{ byterate }, depth_{ depth } {}
+
+            /// Refills the bucket for ticks and returns the video budget for them
+        size_t budget( size_t ticks )
+        {
+            size_t carry = carry_;
+            carry_ = 0;
+
+            if (depth_==0)
+                return byterate_*ticks+carry;
+
+            //  What was not used by the previous frames is banked, up to depth
+            level_ = std::min( level_, (long)depth_ );
+            level_ += byterate_*ticks+carry;
+            return level_>0?level_:0;
+        }
+
+            /// The budget was not used because the frame was dropped: give it to the next one
+            /// With a depth, the bytes simply stay in the bucket, so the depth still bounds it
+        void bank( size_t bytes )
+        {
+            if (depth_==0)
+                carry_ += bytes;
+        }
+
+        void spend( size_t bytes )
+        {
+            if (depth_!=0)
+                level_ -= bytes;
+        }
+
+        long level() const { return level_; }
+
+        void set_byterate( size_t byterate ) { byterate_ = byterate; }
+    };
+
+    /// A dithered image, kept between the two passes
+    struct cached_image
+    {
+        framebuffer fb;                         //  Image to display
+        std::vector<sound_frame_t> sounds;      //  Sound for the ticks
+        size_t ticks;                           //  Number of ticks the image is displayed
+        size_t demand;                          //  Bytes needed by z32 to display it from the previous image
+        bool cut;                               //  First image of a scene
+        bool duplicate;                         //  Same source as the previous image, which was not dithered again
+        word_weights importance;                //  Importance of each word (empty if not computed)
+    };
+
     class EncodingResult
     {
         const codec_spec &codec_;           //  Used codec
-        framebuffer image_;                 //  Resulting image
+        frame_patch patch_;                 //  Words changed on screen
         const std::vector<uint8_t> data_;   //  Resulting data
+        const size_t differences_;          //  Pixels still different after the update
         const double quality_;              //  Resulting quality
 
     public:
@@ -180,18 +550,23 @@ public:
                 const codec_spec &codec,
                 const framebuffer &current,
                 const framebuffer &target,
+                const frame_diff &diff,
+                const word_weights &weights,
                 const size_t budget
         ) :
                 codec_{ codec },
-                image_{ current },
-                data_{ codec_.coder->compress( image_, target,  budget*codec_.penality ) },
-                quality_{ image_.proximity( target ) }
+                patch_{ current.W() },
+                data_{ codec_.coder->compress( patch_, current, target, diff, weights, budget*codec_.penality ) },
+                differences_{ diff.changed_after( current, patch_.merged() ) },
+                quality_{ diff.proximity_for( differences_ ) }
         {
             // char buffer[1024];
             // static int num = 0;
             // sprintf( buffer, "/tmp/foo-%04d.pgm", num );
             // num++;
-            // write_image( buffer, image_.as_image() );
+            // framebuffer image = current;
+            // patch_.apply( image );
+            // write_image( buffer, image.as_image() );
         }
 
         //  Encoded video with codec signature and trailer (#### why trailer?)
@@ -203,7 +578,14 @@ public:
         }
 
         double quality() const { return quality_; }
-        const framebuffer &image() const { return image_; }
+        size_t differences() const { return differences_; }
+        const frame_patch &patch() const { return patch_; }
+        size_t size() const { return data_.size(); }
+
+            /// Tells the codec that this result is the one that will be displayed
+        void commit() const { codec_.coder->commit( data_ ); }
+        std::string codec_name() const { return codec_.coder->name(); }
+        bool full_screen() const { return codec_.coder->full_screen(); }
     };
 
     class CompressorHelper
@@ -215,6 +597,25 @@ public:
         const double fps_;      //  Input fps
         const size_t byterate_;
         bool group_;
+        const size_t vbr_depth_;
+        RateController rate_;
+
+        const double drop_threshold_;       //  Images whose update fixes less than this part of the differences are dropped
+        static const size_t max_consecutive_drops_ = 3;
+        size_t consecutive_drops_ = 0;
+
+        const framebuffer initial_fb_;      //  What was on screen before the first image
+        bool caching_ = false;              //  First pass: images are only dithered and cached
+        std::vector<cached_image> cache_;
+        const vertical_compressor<uint32_t> demand_coder_;
+
+        const size_t lookahead_;                //  Number of future images looked at when encoding one
+        std::deque<cached_image> pending_;      //  Dithered images waiting for their lookahead
+        static constexpr double cut_bonus_ = 0.02;      //  Quality bonus of full screen codecs before a cut
+
+        const double age_half_life_;            //  Ticks after which the priority of a wrong word doubles (0: no aging)
+        std::vector<float> age_;                //  Number of ticks each word of the screen has been wrong
+        static constexpr float max_debt_ = 16;  //  Priority boost of the oldest words
 
         size_t in_fr_;             //  Input frame
         size_t current_tick_;   //  Output tick number
@@ -231,10 +632,7 @@ public:
         public:
             qhistogram() : samples_(N+1) {}
 
-            ~qhistogram()
-            {
-                dump();
-            }
+            bool empty() const { return total_==0; }
 
             void add( double quality )
             {
@@ -278,30 +676,74 @@ public:
             }
         };
 
-        qhistogram<BucketCount> histo_;
+    public:
+            /// Statistics of the encoded frames, for the summary
+            /// Each pass of a two-pass encode starts them again, and the encoder keeps the ones of the pass it keeps
+        struct statistics
+        {
+            qhistogram<BucketCount> histo;
+            size_t candidates = 0;      //  Number of codec runs considered
+            size_t pruned = 0;          //  Number of codec runs skipped because they could not win
+            size_t dropped = 0;         //  Number of dropped images
+            double total_quality = 0;   //  Sum of the quality of the encoded frames
+            size_t total_video = 0;     //  Bytes of video of the encoded frames
+            size_t encoded = 0;         //  Number of encoded (not dropped) frames
+        };
+
+    private:
+        statistics stats_;
+
+        size_t cuts_ = 0;           //  Number of scene cuts detected
+        size_t duplicates_ = 0;     //  Number of duplicate images that were not dithered
 
     public:
         CompressorHelper(
                 Ditherer ditherer,
                 SubtitleBurner subtitle_burner,
-                const std::vector<codec_spec> codecs,
                 const double fps,
-                const size_t byterate,
-                const bool group
+                const EncodingParameters &ep
         ) :
                 ditherer_{std::move( ditherer )},
                 subtitle_burner_{std::move( subtitle_burner )},
                 current_fb_{ ditherer_.current() },
-                codecs_{ codecs },
+                codecs_{ ep.codecs_ },
                 fps_{ fps },
-                byterate_{ byterate },
-                group_{ group }
+                byterate_{ ep.byterate_ },
+                group_{ ep.group_ },
+                vbr_depth_{ ep.vbr_depth_ },
+                rate_{ ep.byterate_, ep.vbr_depth_ },
+                drop_threshold_{ ep.drop_threshold_ },
+                initial_fb_{ current_fb_ },
+                demand_coder_{ current_fb_.W(), current_fb_.H(), uint32_ruler::ruler },
+                lookahead_{ ep.lookahead_ },
+                age_half_life_{ ep.age_half_life_ },
+                age_( current_fb_.W()/32*current_fb_.H() )
         {
             current_tick_ = 0;
             in_fr_ = 0;
             //current_audio_ = std::begin( audio_ );
         }
 
+        ~CompressorHelper()
+        {
+            if (!stats_.histo.empty())
+                stats_.histo.dump();
+            if (stats_.candidates)
+                std::clog << "Pruned " << stats_.pruned << " of " << stats_.candidates << " codec candidates (" << stats_.pruned*100.0/stats_.candidates << "%)\n";
+            if (stats_.dropped)
+                std::clog << "Dropped " << stats_.dropped << " images\n";
+            if (cuts_)
+                std::clog << "Detected " << cuts_ << " scene cuts\n";
+            if (ditherer_.warped())
+                std::clog << "Motion compensated " << ditherer_.warped() << " images\n";
+            if (duplicates_)
+                std::clog << "Deduplicated " << duplicates_ << " of " << in_fr_ << " images (" << duplicates_*100.0/in_fr_ << "%)\n";
+            if (ditherer_.kept_tiles()>0)
+                std::clog << "Reused the dithering of " << ditherer_.kept_tiles()*100 << "% of the tiles\n";
+            if (stats_.encoded)
+                std::clog << "Encoded " << stats_.encoded << " frames, average quality " << stats_.total_quality/stats_.encoded*100 << "%, " << stats_.total_video/(double)stats_.encoded << " bytes of video per frame\n";
+        }
+
         size_t get_local_ticks_until_next_frame() const {
             size_t local_ticks = 1;
 
@@ -318,28 +760,112 @@ public:
 
         size_t get_ticks_qty() const {return current_tick_;}
 
-        std::vector<frame>* process_image(const image &img_src, const std::vector<sound_frame_t> &snd_vector) {
-            auto* frames = new std::vector<frame>();
+        //  An image is dropped when even the best codec would only fix a small part of what changed:
+        //  spending the budget on a muddy half-update is worse than giving twice the budget to the next image
+        bool should_drop( const frame_diff &diff, const EncodingResult &best ) const
+        {
+            if (drop_threshold_<=0 || diff.clean() || consecutive_drops_>=max_consecutive_drops_)
+                return false;
+            size_t fixed = diff.changed()>best.differences()?diff.changed()-best.differences():0;
+            return fixed<drop_threshold_*diff.changed();
+        }
 
-            //  Dither the new image
-            ditherer_.dither( img_src );
-            image dest = ditherer_.current();
-            subtitle_burner_.burn_into( dest, in_fr_/fps_ );
+        //  A frame that leaves the screen untouched (null codec), but still carries the sound and the ticks
+        frame dropped_frame( const framebuffer &fb, size_t local_ticks, const std::vector<uint8_t> &audio, const frame_diff &diff, size_t video_budget )
+        {
+            rate_.bank( video_budget );
+            age_words( diff, local_ticks );
+
+            frame f{ fb, local_ticks, { 0x00, 0x00, 0x00, 0x00 }, audio, current_fb_ };
+            f.codec = "drop";
+            f.budget = video_budget;
+            f.bucket = rate_.level();
+            f.quality = diff.proximity_for( diff.changed() );
+            return f;
+        }
 
-            //  True B&W packed image
-            framebuffer fb{ dest };
+        //  Words that are still wrong on screen after ticks get older, the others are fixed
+        void age_words( const frame_diff &diff, size_t ticks )
+        {
+            if (age_half_life_==0)
+                return;
+            for (size_t o=0;o!=age_.size();o++)
+                age_[o] = diff.xor_word( o )?age_[o]+ticks:0;
+        }
 
-            //  Let's see how many ticks we have to display this image
-            in_fr_++;
-            size_t next_tick = ticks_from_frame( in_fr_, fps_ );
-            size_t ticks = next_tick-current_tick_;
+        //  The longer a word has been wrong, the more it is worth fixing, so that low contrast areas
+        //  are not starved by high contrast flicker. The priority doubles every half-life.
+        //  The ages are taken at the start of the image, so the weights do not change across its ticks.
+        void add_age_debt( word_weights &weights ) const
+        {
+            if (age_half_life_==0)
+                return;
+            if (weights.empty())
+                weights.assign( age_.size(), 1 );
+            for (size_t o=0;o!=weights.size();o++)
+                weights[o] *= std::min( std::exp2( age_[o]/(float)age_half_life_ ), max_debt_ );
+        }
 
-            assert( ticks>0 );
+        //  Words of fb that change again in the next images are less worth updating:
+        //  the sooner they change, the lower their weight
+        template <typename IT>
+        word_weights lookahead_weights( const framebuffer &fb, IT future_begin, IT future_end ) const
+        {
+            word_weights weights;
+            size_t depth = std::distance( future_begin, future_end );
+            if (depth==0)
+                return weights;
+
+            size_t words = fb.W()/32*fb.H();
+            weights.assign( words, 1 );
+            size_t k = 1;
+            for (auto it=future_begin;it!=future_end;it++,k++)
+                for (size_t o=0;o!=words;o++)
+                    if (weights[o]==1 && it->fb.word( o )!=fb.word( o ))
+                        weights[o] = k/(float)(depth+1);
+            return weights;
+        }
+
+        //  Encodes the ticks for displaying img, adding the frames to frames
+        //  The images from future_begin to future_end are the ones that will be displayed next
+        template <typename IT>
+        void encode_image( std::vector<frame> &frames, const cached_image &img, IT future_begin, IT future_end, size_t frame_index )
+        {
+            const framebuffer &fb = img.fb;
+            const std::vector<sound_frame_t> &snd_vector = img.sounds;
+            size_t ticks = img.ticks;
 
             size_t local_ticks = 1;
             if (group_)
                 local_ticks = ticks;
 
+            bool drop = false;      //  Decided on the first ticks of the image
+
+            auto weights = lookahead_weights( fb, future_begin, future_end );
+            if (weights.empty())
+                weights = img.importance;
+            else if (!img.importance.empty())
+                for (size_t o=0;o!=weights.size();o++)
+                    weights[o] *= img.importance[o];
+            add_age_debt( weights );
+
+            //  Before a cut, there is no point in carefully updating details that will be erased
+            bool cut_ahead = future_begin!=future_end && future_begin->cut;
+
+            //  On a cut, the whole screen changes, so whole screen codecs are tried first
+            std::vector<const codec_spec *> codecs;
+            for (auto &codec:codecs_)
+                codecs.push_back( &codec );
+            if (img.cut)
+                std::stable_partition( std::begin(codecs), std::end(codecs), []( auto codec ) { return codec->coder->full_screen(); } );
+            auto bonus = [&]( bool full_screen ) { return (cut_ahead && full_screen)?cut_bonus_:0; };
+            auto score = [&]( const EncodingResult &r ) { return r.quality()+bonus( r.full_screen() ); };
+
+            //  What needs to change on screen, shared by all codecs
+            //  It is kept up to date with the applied patches across the ticks of the image,
+            //  and so is the codec state that depends on it
+            frame_diff diff{ current_fb_, fb };
+
             for (size_t i=0;i!=ticks;i+=local_ticks) {
                 //  Add as much audio as we have for the local ticks
                 std::vector<uint8_t> audio;
@@ -351,40 +877,183 @@ public:
                     std::copy(snd.begin(), snd.end(), std::back_inserter(audio));
                 }
 
-                std::stringstream filePath;
-                filePath << "/tmp/test/" << in_fr_ << ".pgm";
-
-                 write_image( filePath.str().c_str(), fb.as_image() );
-                 //write_image( filePath.str().c_str(), dest );
+                //  Debug dump of each image, with -g only
+                if (sDebug)
+                {
+                    std::stringstream filePath;
+                    filePath << "/tmp/test/" << frame_index << ".pgm";
+                    write_image( filePath.str().c_str(), fb.as_image() );
+                }
 
                 //  Compute the video budget?
-                size_t video_budget = byterate_*local_ticks;
+                size_t video_budget = rate_.budget( local_ticks );
+
+                if (drop)
+                {
+                    frames.push_back( dropped_frame( fb, local_ticks, audio, diff, video_budget ) );
+                    continue;
+                }
 
                 //  Encode within that budget with every codec
+                //  Codecs that cannot do strictly better than an earlier result are skipped,
+                //  as the earlier one would win the tie anyway
                 std::vector<EncodingResult> encoding_results;
-                std::transform(std::begin(codecs_), std::end(codecs_), std::back_inserter(encoding_results), [&]( auto &codec )-> EncodingResult
-                { return EncodingResult(
-                        codec,
-                        current_fb_,
-                        fb,
-                        video_budget*codec.penality
-                ); } );
+                double best_score = 0;
+                for (auto codec_ptr:codecs)
+                {
+                    auto &codec = *codec_ptr;
+                    size_t budget = video_budget*codec.penality;
+                    stats_.candidates++;
+                    if (!encoding_results.empty() && diff.proximity_for( codec.coder->min_differences( diff, budget*codec.penality ) )+bonus( codec.coder->full_screen() )<=best_score)
+                    {
+                        stats_.pruned++;
+                        continue;
+                    }
+                    encoding_results.emplace_back( codec, current_fb_, fb, diff, weights, budget );
+                    best_score = std::max( best_score, score( encoding_results.back() ) );
+                }
 
                 //  Find the result with the highest quality
-                auto best_result = std::max_element(encoding_results.begin(), encoding_results.end(), [](const EncodingResult& r1, const EncodingResult& r2) { return r1.quality() < r2.quality(); } );
+                auto best_result = std::max_element(encoding_results.begin(), encoding_results.end(), [&](const EncodingResult& r1, const EncodingResult& r2) { return score( r1 ) < score( r2 ); } );
+
+                //  Not worth it: keep the previous image and save the budget for the next one
+                if (i==0 && should_drop( diff, *best_result ))
+                {
+                    drop = true;
+                    consecutive_drops_++;
+                    stats_.dropped++;
+                    frames.push_back( dropped_frame( fb, local_ticks, audio, diff, video_budget ) );
+                    frames.back().cut = img.cut;
+                    frames.back().duplicate = img.duplicate;
+                    continue;
+                }
+                if (i==0)
+                    consecutive_drops_ = 0;
+
+                //  Only the winner is drawn on screen
+                diff.apply( current_fb_, best_result->patch() );
+                best_result->patch().apply( current_fb_ );
+                best_result->commit();
+                rate_.spend( best_result->size() );
+                age_words( diff, local_ticks );
 
                 //  Construct the frame with the best video and audio
-                frame f{ fb, local_ticks, best_result->get_video_encoded_data(), audio, best_result->image() };
+                frame f{ fb, local_ticks, best_result->get_video_encoded_data(), audio, current_fb_ };
+                f.codec = best_result->codec_name();
+                f.budget = video_budget;
+                f.bucket = rate_.level();
+                f.quality = best_result->quality();
+                f.cut = img.cut && i==0;
+                f.duplicate = img.duplicate && i==0;
+
+                stats_.histo.add( f.quality );
+                stats_.total_quality += f.quality;
+                stats_.total_video += f.video.size();
+                stats_.encoded++;
+
+                frames.push_back( f );
+            }
+        }
+
+        std::vector<frame>* process_image(const image &img_src, const std::vector<sound_frame_t> &snd_vector, bool duplicate, const motion_field &motion) {
+            auto* frames = new std::vector<frame>();
+
+            //  Dither the new image
+            //  A duplicate of the previous source keeps its dithering: its ticks are only spent
+            //  converging the screen to the same target
+            if (duplicate)
+                duplicates_++;
+            else
+                ditherer_.dither( img_src, motion );
+            image dest = ditherer_.current();
+            bool cut = !duplicate && ditherer_.cut();
+            if (cut)
+                cuts_++;
+            word_weights importance = ditherer_.importance();
+            if (subtitle_burner_.burn_into( dest, in_fr_/fps_ ))
+                ditherer_.mark_subtitle( importance, dest );
+
+            //  True B&W packed image
+            framebuffer fb{ dest };
+
+            //  Let's see how many ticks we have to display this image
+            in_fr_++;
+            size_t next_tick = ticks_from_frame( in_fr_, fps_ );
+            size_t ticks = next_tick-current_tick_;
 
-                frames->push_back( f );
+            assert( ticks>0 );
 
-                current_fb_ = best_result->image();
+            if (caching_)
+            {
+                    //  First pass: what z32 would need to display this image perfectly
+                const framebuffer &previous = cache_.empty()?initial_fb_:cache_.back().fb;
+                frame_diff diff{ previous, fb };
+                frame_patch patch{ fb.W() };
+                size_t demand = static_cast<const compressor &>( demand_coder_ ).compress( patch, previous, fb, diff, {}, fb.W()*fb.H() ).size();
+                cache_.push_back( { fb, snd_vector, ticks, demand, cut, duplicate, importance } );
+            }
+            else
+            {
+                    //  Images wait in the lookahead buffer until enough future images are known
+                pending_.push_back( { fb, snd_vector, ticks, 0, cut, duplicate, importance } );
+                while (pending_.size()>lookahead_)
+                    encode_pending( *frames );
             }
 
             current_tick_ = next_tick;
 
             return frames;
         }
+
+        //  Encodes the oldest image of the lookahead buffer
+        void encode_pending( std::vector<frame> &frames )
+        {
+            encode_image( frames, pending_.front(), pending_.begin()+1, pending_.end(), in_fr_-pending_.size()+1 );
+            pending_.pop_front();
+        }
+
+        //  Encodes the images still in the lookahead buffer, at the end of the movie
+        std::vector<frame> flush()
+        {
+            std::vector<frame> frames;
+            while (!pending_.empty())
+                encode_pending( frames );
+            return frames;
+        }
+
+        //  Two-pass encoding: the images are dithered once and cached, then encoded with a per-frame byterate
+
+        void set_caching( bool caching ) { caching_ = caching; }
+
+        const std::vector<cached_image> &cache() const { return cache_; }
+
+        const framebuffer &initial_framebuffer() const { return initial_fb_; }
+
+        const statistics &stats() const { return stats_; }
+        void set_stats( const statistics &stats ) { stats_ = stats; }
+
+        //  Encodes all the cached images from the start, with the given byterate for each of them
+        std::vector<frame> encode_cache( const std::vector<size_t> &byterates )
+        {
+            assert( byterates.size()==cache_.size() );
+
+            std::vector<frame> frames;
+            current_fb_ = initial_fb_;
+            stats_ = {};
+            rate_ = RateController{ byterate_, vbr_depth_ };
+            consecutive_drops_ = 0;
+            std::fill( std::begin(age_), std::end(age_), 0 );
+            for (auto &codec:codecs_)
+                codec.coder->restart();
+
+            for (size_t i=0;i!=cache_.size();i++)
+            {
+                rate_.set_byterate( byterates[i] );
+                encode_image( frames, cache_[i], cache_.begin()+i+1, cache_.begin()+std::min( i+1+lookahead_, cache_.size() ), i+1 );
+            }
+
+            return frames;
+        }
     };
 
 private:
@@ -454,6 +1123,12 @@ public:
             spec.penality = 1.00;
             spec.coder = std::make_shared<vertical_compressor<uint32_t>>( W, H, uint32_ruler::ruler );
         }
+        else if (name=="z32s")
+        {
+            spec.signature = 0x06;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<vertical_compressor<uint32_t>>( W, H, uint32_ruler::ruler, true );
+        }
         else if (name=="z32old")
         {   
             static bit_ruler<uint32_t> br32;
@@ -473,6 +1148,36 @@ public:
             spec.penality = 1.00;
             spec.coder = std::make_shared<copy_line_compressor>( W, H );
         }
+        else if (name=="scroll")
+        {
+            spec.signature = 0x05;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<scroll_compressor>( W, H );
+        }
+        else if (name=="tiles")
+        {
+            spec.signature = 0x07;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<tile_compressor>( W, H );
+        }
+        else if (name=="regions")
+        {
+            spec.signature = 0x08;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<region_compressor>( W, H );
+        }
+        else if (name=="mlines")
+        {
+            spec.signature = 0x09;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<multi_line_compressor>( W, H );
+        }
+        else if (name=="xor")
+        {
+            spec.signature = 0x0a;
+            spec.penality = 1.00;
+            spec.coder = std::make_shared<xor_compressor>( W, H );
+        }
         else if (name=="null")
         {   
             spec.signature = 0x00;
@@ -523,17 +1228,19 @@ public:
             return 0;
     }
 
-    void compress(image& img, std::vector<sound_frame_t>& sound_frames) {
+    //  A duplicate image is the same as the previous one, and is not dithered again
+    //  motion is the block motion of the source since the previous image, if known
+    void compress(image& img, std::vector<sound_frame_t>& sound_frames, bool duplicate = false, const motion_field &motion = {}) {
         if(!helper)
             return;
 
-        std::vector<frame>* frames = helper->process_image(img, sound_frames);
+        std::vector<frame>* frames = helper->process_image(img, sound_frames, duplicate, motion);
 
         frames_.insert(frames_.end(), frames->begin(), frames->end());
         delete frames;
     }
 
-    void init_compressor(double stability, size_t byterate, bool group, const std::string &filters, const std::string &watermark, const std::vector<codec_spec> &codecs, image::dithering dither, bool bars, const std::string error_algorithm, float error_bleed, bool error_bidi )
+    void init_compressor( const DitheringParameters &dp, const EncodingParameters &ep )
     {
         image previous( W_, H_ );
         fill( previous, 0 );
@@ -546,24 +1253,51 @@ static bool generate_initial_frame = false;
             //  #### We painfully extract what the first image should be
             image img0( W_,H_ );
 //            copy( img0, images_[0], bars );
-            image img1 = filter( img0, filters.c_str() );
+            image img1 = filter( img0, dp.filters_.c_str() );
             image img2( W_,H_ );
-            if (dither==image::error_diffusion)
-                error_diffusion( img2, img1, previous, stability, *get_error_diffusion_by_name( error_algorithm ), error_bleed, error_bidi );
-            else if (dither==image::ordered)
+            if (dp.dither_==image::error_diffusion)
+                error_diffusion( img2, img1, previous, dp.stability_, *get_error_diffusion_by_name( dp.error_algorithm_ ), dp.error_bleed_, dp.error_bidi_ );
+            else if (dp.dither_==image::ordered)
                 ordered_dither( img2, img1, previous );
             round_corners( img2 );
-            ::watermark( img2, watermark );
+            ::watermark( img2, dp.watermark_ );
             copy( previous, img2 );
             write_image( "/tmp/start.pgm", previous );
         }
 
 
-    DitheringParameters dp { bars, filters, dither, error_algorithm, stability, error_bleed, error_bidi, watermark };
     Ditherer d{ previous, dp };
     SubtitleBurner sb{  subtitles_ };
 
-    helper = new CompressorHelper(d, sb, codecs, fps_, byterate, group );
+    helper = new CompressorHelper(d, sb, fps_, ep );
+    }
+
+    //  Two-pass encoding support
+
+    void set_caching( bool caching ) {
+        if (helper)
+            helper->set_caching( caching );
+    }
+
+    const std::vector<cached_image> &cache() const { return helper->cache(); }
+
+    //  What is on screen before the first frame
+    const framebuffer &initial_framebuffer() const { return helper->initial_framebuffer(); }
+
+    std::vector<frame> encode_cache( const std::vector<size_t> &byterates ) { return helper->encode_cache( byterates ); }
+
+    //  Statistics of the last encode_cache pass, to be restored with the frames of the pass that is kept
+    const CompressorHelper::statistics &stats() const { return helper->stats(); }
+    void set_stats( const CompressorHelper::statistics &stats ) { helper->set_stats( stats ); }
+
+    //  Encodes the images left in the lookahead buffer
+    void flush() {
+        if (helper)
+            add_frames( helper->flush() );
+    }
+
+    void add_frames( std::vector<frame> frames ) {
+        frames_.insert( frames_.end(), std::make_move_iterator( frames.begin() ), std::make_move_iterator( frames.end() ) );
     }
 
     frame* extract_frame() {
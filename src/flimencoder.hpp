@@ -4,17 +4,21 @@
 #include <string>
 
 #include "flimcompressor.hpp"
+#include "frameverifier.hpp"
 #include "framegenerator.hpp"
 
 #include "reader.hpp"
 #include "writer.hpp"
 
 #include <sstream>
+#include <ctime>
+#include <chrono>
 #include <libavutil/frame.h>
 #include <libavcodec/packet.h>
 #include <libavformat/avformat.h>
 
 extern bool sDebug;
+extern const std::chrono::steady_clock::time_point sProcessStart;
 
 /**
  * A set of encoding parameters
@@ -26,8 +30,12 @@ protected:
     size_t H_ = 342;
 
     size_t byterate_ = 2000;
+    size_t vbr_depth_ = 0;          //  Rate control bucket depth in bytes (0: constant byterate)
     double stability_ = 0.3;
     int fps_ratio_ = 1;
+    double drop_threshold_ = 0;     //  Dynamic frame dropping (0: never drop)
+    size_t lookahead_ = 0;          //  Number of future images considered when encoding (0: greedy)
+    double age_half_life_ = 0;      //  Ticks for the priority of a wrong word to double (0: no aging)
     bool group_ = true;
     std::string filters_ = "c";
     bool bars_ = true;              //  Do we put black bars around the image?
@@ -36,6 +44,10 @@ protected:
     std::string error_algorithm_ = "floyd";
     float error_bleed_ = 1;
     bool error_bidi_ = false;
+    bool importance_ = false;       //  Spend the budget on the parts of the image that matter most
+    double tile_threshold_ = 0;     //  Average change under which a tile of the source is not dithered again
+    bool dedupe_ = false;           //  Duplicate source images only add ticks to the previous one
+    bool motion_ = false;           //  Dither over the previous image moved along the decoded motion vectors
 
     bool silent_ = false;
 
@@ -53,12 +65,27 @@ public:
     size_t byterate() const { return byterate_; }
     void set_byterate( size_t byterate ) { byterate_ = byterate; }
 
+    size_t vbr_depth() const { return vbr_depth_; }
+    void set_vbr_depth( size_t vbr_depth ) { vbr_depth_ = vbr_depth; }
+
         //  Technically, we could put the half-rate/fps_ratio mecanism in the reader phase
         //  to avoid reading unecessary images, but it is more generic to put it here
         //  as it could allows to extend to dynamic half rate [yagni]
     int fps_ratio() const { return fps_ratio_; }
     void set_fps_ratio( int fps_ratio ) { fps_ratio_ = fps_ratio; }
 
+        //  Dynamic frame dropping: images where the update would fix less than
+        //  this part of the changed pixels are skipped, and their budget goes to the next image
+    double drop_threshold() const { return drop_threshold_; }
+    void set_drop_threshold( double drop_threshold ) { drop_threshold_ = drop_threshold; }
+
+    size_t lookahead() const { return lookahead_; }
+    void set_lookahead( size_t lookahead ) { lookahead_ = lookahead; }
+
+        //  Words that stay wrong on screen get more and more priority, doubling every half-life
+    double age_half_life() const { return age_half_life_; }
+    void set_age_half_life( double age_half_life ) { age_half_life_ = age_half_life; }
+
     bool group() const { return group_; }
     void set_group( bool group ) { group_ = group; }
 
@@ -90,6 +117,23 @@ public:
     bool error_bidi() const { return error_bidi_; }
     void set_error_bidi( bool error_bidi ) { error_bidi_ = error_bidi; }
 
+        //  Codecs favour details, the centre of the screen and subtitles over flat areas, borders and black bars
+    bool importance() const { return importance_; }
+    void set_importance( bool importance ) { importance_ = importance; }
+
+        //  Tiles of 32x32 pixels that changed less than this on average keep their previous dithering
+    double tile_threshold() const { return tile_threshold_; }
+    void set_tile_threshold( double tile_threshold ) { tile_threshold_ = tile_threshold; }
+
+        //  Source images that are the same as the previous one are not dithered again,
+        //  their ticks are spent converging to the previous image
+    bool dedupe() const { return dedupe_; }
+    void set_dedupe( bool dedupe ) { dedupe_ = dedupe; }
+
+        //  The previous dithered image follows the motion vectors of the source, so pans move the dither pattern
+    bool motion() const { return motion_; }
+    void set_motion( bool motion ) { motion_ = motion; }
+
     double stability() const { return stability_; }
     void set_stability( double stability ) { stability_ = stability; }
 
@@ -283,7 +327,15 @@ public:
         std::ostringstream cmd;
 
         cmd << "--byterate " << byterate_;
+        if (vbr_depth_)
+            cmd << " --vbr-depth " << vbr_depth_;
         cmd << " --fps-ratio " << fps_ratio_;
+        if (drop_threshold_>0)
+            cmd << " --drop-threshold " << drop_threshold_;
+        if (lookahead_)
+            cmd << " --lookahead " << lookahead_;
+        if (age_half_life_>0)
+            cmd << " --age-half-life " << age_half_life_;
         cmd << " --group " << (group_?"true":"false");
         cmd << " --bars " << (bars_?"true":"false");
         cmd << " --dither " << dither_string();
@@ -295,6 +347,14 @@ public:
             cmd << " --error-bleed " << error_bleed_;
         }
         cmd << " --filters " << filters_;
+        if (importance_)
+            cmd << " --importance true";
+        if (tile_threshold_>0)
+            cmd << " --tile-threshold " << tile_threshold_;
+        if (dedupe_)
+            cmd << " --dedupe true";
+        if (motion_)
+            cmd << " --motion true";
 
         for (auto &c:codecs_)
             cmd << " --codec " << c.coder->description();
@@ -317,6 +377,13 @@ class flimencoder
     std::string change_pattern_ = "change-%06d.pgm"s;
     std::string diff_pattern_ = "diff-%06d.pgm"s;
     std::string target_pattern_ = "target-%06d.pgm"s;
+    std::string stats_file_;
+    size_t target_size_ = 0;        //  If not zero, two-pass encode to get a flim of that size
+    bool verify_ = false;           //  Decode the written frames and check them against the encoder
+    std::unique_ptr<frame_verifier> verifier_;
+
+    std::ofstream stats_;
+    size_t stats_frame_ = 0;
 
     std::vector<subtitle> subtitles_;
 
@@ -336,8 +403,11 @@ class flimencoder
     std::string watermark_;
 
     size_t movie_size_ = 0;
+    uint32_t codecs_used_ = 0;      //  Bitmap of the codecs of the written frames (bit n for codec n)
     long fletcher_movie_size_ = 0;
 
+    bool first_frame_written_ = false;  //  For the time-to-first-frame startup benchmark
+
     size_t cover_begin_;        /// Begin index of cover image
     size_t cover_end_;          /// End index of cover image
 
@@ -379,12 +449,11 @@ class flimencoder
         return res;
     }
 
-    void write_frame(flimcompressor::frame& frm) {
-        std::vector<uint8_t> movie; //  #### Should be 'frames'
+    //  The bytes of a frame in the movie section
+    std::vector<uint8_t> movie_from_frame( const flimcompressor::frame& frm ) const {
+        std::vector<uint8_t> movie;
         auto out_movie = std::back_inserter( movie );
 
-        size_t frame_start = movie.size();
-
         write2( out_movie, frm.ticks );
 
         if (!profile_.silent())
@@ -401,18 +470,44 @@ class flimencoder
         write2( out_movie, frm.video.size()+2 );
         write( out_movie, frm.video );
 
+        return movie;
+    }
+
+    void write_frame(flimcompressor::frame& frm) {
+        std::vector<uint8_t> movie = movie_from_frame( frm );
+
         //  TOC entry for current frame
-        write2( *out_toc_, movie.size()-frame_start );
+        write2( *out_toc_, movie.size() );
 
         movie_size_ += movie.size();
+        codecs_used_ |= 1u<<frm.video[3];
 
         out_.write(reinterpret_cast<char*>(movie.data()), movie.size());
 
+        if (verify_)
+        {
+            if (!verifier_)
+                verifier_ = std::make_unique<frame_verifier>( compressor->initial_framebuffer() );
+            verifier_->push( frm.video, frm.result );
+        }
+
+            //  Startup benchmark, with --stats. Not meaningful in two-pass mode, where all the passes come first
+        if (!first_frame_written_)
+        {
+            first_frame_written_ = true;
+            if (stats_.is_open() && !target_size_)
+                std::clog << "Time to first frame: " << std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now()-sProcessStart ).count() << " ms\n";
+        }
+
         for (size_t i=0;i != movie.size();i+=2)
         {
             fletcher_movie_size_ += ((int)(movie[i]))*256+movie[i+1];
             fletcher_movie_size_ %= 65535;
         }
+
+        if (stats_.is_open())
+            stats_ << stats_frame_ << "," << frm.ticks << "," << frm.codec << "," << frm.video.size() << "," << frm.budget << "," << frm.bucket << "," << frm.quality << "," << frm.cut << "," << frm.duplicate << "\n";
+        stats_frame_++;
     }
 
     framegenerator<AVFrame*, AVFrame*> av_to_av_encoder() {
@@ -461,7 +556,7 @@ class flimencoder
                     delete snd_ptr;
                 }
 
-                compressor->compress(*img, sound_frames);
+                compressor->compress(*img, sound_frames, profile_.dedupe() && f_reader->last_frame_duplicate(), f_reader->last_frame_motion());
                 delete img;
                 sound_frames.clear();
             }
@@ -483,6 +578,93 @@ class flimencoder
         av_frame_free(&frame);
     }
 
+    //  Size of a flim containing these frames, as written by encode_av_to_av
+    size_t flim_size( const std::vector<flimcompressor::frame> &frames ) const {
+        size_t size = 1024 + 4+4*10 + 20 + 128*86/8;    //  comment, header, global info and poster
+        for (auto &f:frames)
+            size += movie_from_frame( f ).size() + 2;   //  frame and its TOC entry
+        return size;
+    }
+
+    //  Second pass: find the per-image byterates that give a flim of target_size_ bytes
+    //  Each image gets a share proportional to its first pass demand, capped to the profile byterate
+    void fit_to_target_size() {
+        auto &cache = compressor->cache();
+        if (cache.empty())
+            throw "No images to encode";
+
+        std::vector<size_t> byterates( cache.size() );
+        auto byterates_for = [&]( double k ) {
+            bool capped = true;
+            for (size_t i=0;i!=cache.size();i++)
+            {
+                double rate = k*cache[i].demand/cache[i].ticks;
+                if (cache[i].demand && rate<profile_.byterate())
+                    capped = false;
+                byterates[i] = std::min( (size_t)rate, profile_.byterate() );
+            }
+            return capped;
+        };
+
+            //  Start with the whole budget (minus what a movie with no video would take) spread on the demand
+        size_t total_demand = 1;
+        for (auto &c:cache)
+            total_demand += c.demand;
+        byterates_for( 0 );
+        size_t empty_size = flim_size( compressor->encode_cache( byterates ) );
+        if (empty_size>=target_size_)
+            throw "Target size is too small for the audio and headers";
+
+        double k = (target_size_-empty_size)/(double)total_demand;
+        double lo = 0;
+        double hi = std::numeric_limits<double>::max();
+
+        std::vector<flimcompressor::frame> best;
+        size_t best_size = 0;
+        flimcompressor::CompressorHelper::statistics best_stats;
+
+        for (int pass=2;pass!=12;pass++)
+        {
+            bool capped = byterates_for( k );
+            auto frames = compressor->encode_cache( byterates );
+            size_t size = flim_size( frames );
+
+            std::clog << "Pass " << pass << " : " << size << " bytes for a target of " << target_size_ << "\n";
+
+            if (size<=target_size_ && size>=best_size)
+            {
+                best = std::move( frames );
+                best_size = size;
+                best_stats = compressor->stats();
+            }
+
+            if (size<=target_size_ && target_size_-size<=target_size_/100)
+                break;
+
+            if (size<=target_size_ && capped)
+            {
+                std::clog << "Target size cannot be reached without exceeding the profile byterate\n";
+                break;
+            }
+
+                //  Rescale on the video part, staying within the known bounds
+            if (size<target_size_)
+                lo = k;
+            else
+                hi = k;
+            double next = k*(target_size_-empty_size)/(double)std::max( size-empty_size, (size_t)1 );
+            if (next<=lo || next>=hi)
+                next = hi==std::numeric_limits<double>::max()?k*2:(lo+hi)/2;
+            k = next;
+        }
+
+        if (best.empty())
+            throw "Could not fit the flim in the target size";
+
+        compressor->set_stats( best_stats );
+        compressor->add_frames( std::move( best ) );
+    }
+
     void encode_av_to_av(const std::string &flim_pathname) {
         auto encoder = av_to_av_encoder();
         auto* f_reader = dynamic_cast<ffmpeg_reader*>(reader);
@@ -518,8 +700,22 @@ class flimencoder
             if(a_frame)
                 av_frame_free(&a_frame);
         }
+
+        if (target_size_)
+            fit_to_target_size();
+
+        //  Images still in the lookahead buffer
+        compressor->flush();
+        while (!compressor->frame_buffer_empty()) {
+            flimcompressor::frame* encoded_frame = compressor->extract_frame();
+            write_frame(*encoded_frame);
+            delete encoded_frame;
+        }
+
         out_.close();
 
+        if (verifier_)
+            std::clog << "Verified " << verifier_->finish() << " frames\n";
 
         std::vector<u_int8_t> global;
         auto out_global = std::back_inserter( global );
@@ -533,6 +729,7 @@ class flimencoder
 
         std::cout << "PROFILE BYTERATE " << profile_.byterate() << "\n";
         write2( out_global, profile_.byterate() );      //  Byterate
+        write4( out_global, codecs_used_ );             //  Codecs used, so the player only prepares what they need
 
         framebuffer poster_fb{ *poster_small_bw_ };
         std::vector<u_int8_t> poster = poster_fb.raw_values_natural<u_int8_t>();
@@ -645,6 +842,9 @@ public:
     void set_diff_pattern( const std::string pattern ) { diff_pattern_ = pattern; }
     void set_change_pattern( const std::string pattern ) { change_pattern_ = pattern; }
     void set_target_pattern( const std::string pattern ) { target_pattern_ = pattern; }
+    void set_stats_file( const std::string stats_file ) { stats_file_ = stats_file; }
+    void set_target_size( size_t target_size ) { target_size_ = target_size; }
+    void set_verify( bool verify ) { verify_ = verify; }
     void set_poster_ts( double poster_ts ) { poster_ts_ = poster_ts; }
     void set_subtitles( const std::vector<subtitle> &subtitles ) { subtitles_ = subtitles; /* yes, it is a copy */ }
 
@@ -656,17 +856,39 @@ public:
         reader = r;
 
         compressor = new flimcompressor(profile_.width(), profile_.height(), fps_ / profile_.fps_ratio(), subtitles_ );
-        compressor->init_compressor( profile_.stability(),
-                                     profile_.byterate(),
-                                     profile_.group(),
-                                     profile_.filters(),
-                                     watermark_,
-                                     profile_.codecs(),
-                                     profile_.dither(),
-                                     profile_.bars(),
-                                     profile_.error_algorithm(),
-                                     profile_.error_bleed(),
-                                     profile_.error_bidi());
+        compressor->init_compressor( {
+                                        .bars_ = profile_.bars(),
+                                        .filters_ = profile_.filters(),
+                                        .dither_ = profile_.dither(),
+                                        .error_algorithm_ = profile_.error_algorithm(),
+                                        .stability_ = profile_.stability(),
+                                        .error_bleed_ = profile_.error_bleed(),
+                                        .error_bidi_ = profile_.error_bidi(),
+                                        .watermark_ = watermark_,
+                                        .importance_ = profile_.importance(),
+                                        .tile_threshold_ = profile_.tile_threshold(),
+                                        .motion_ = profile_.motion()
+                                     }, {
+                                        .codecs_ = profile_.codecs(),
+                                        .byterate_ = profile_.byterate(),
+                                        .group_ = profile_.group(),
+                                        .vbr_depth_ = profile_.vbr_depth(),
+                                        .drop_threshold_ = profile_.drop_threshold(),
+                                        .lookahead_ = profile_.lookahead(),
+                                        .age_half_life_ = profile_.age_half_life()
+                                     } );
+
+        //  First pass only dithers and caches the images
+        if (target_size_)
+            compressor->set_caching( true );
+
+        if (stats_file_!="")
+        {
+            stats_.open( stats_file_ );
+            if (!stats_.good())
+                throw "Cannot open stats file";
+            stats_ << "frame,ticks,codec,video_bytes,budget,bucket,quality,cut,duplicate\n";
+        }
 
         encode_av_to_av(flim_pathname);
     }
@@ -44,6 +44,9 @@ using namespace std::string_literals;
 // True if the global '-g' option was set
 bool sDebug = false;
 
+// Wall clock time at static initialisation, for the time-to-first-frame benchmark
+const std::chrono::steady_clock::time_point sProcessStart = std::chrono::steady_clock::now();
+
 // If defined, we add a "stamp" to each stream, to know where it is coming from
 #define noSTAMP
 
@@ -146,7 +149,14 @@ void usage(const std::string name) {
     std::cerr << "      Default is 'se30'. See below for description of profiles.\n";
     std::cerr << "    --silent BOOLEAN            : set to true for silent flims\n";
     std::cerr << "    --byterate BYTERATE         : bytes per ticks available for video compression\n";
+    std::cerr << "    --target-size BYTES         : two-pass encoding to get a flim of that size (within 1%). The byterate becomes the maximum.\n";
+    std::cerr << "    --vbr-depth BYTES           : size of the rate control bucket. Frames can borrow up to that many bytes saved by previous frames.\n";
+    std::cerr << "      Keep it below the player buffer size. Default 0 (constant byterate).\n";
     std::cerr << "    --fps-ratio BOOLEAN         : ratio of images from the source to drop.\n";
+    std::cerr << "    --drop-threshold FLOAT      : drops images when the update would fix less than that part of the changed pixels,\n";
+    std::cerr << "      giving their budget to the next image (at most 3 in a row). Default 0 (never drop).\n";
+    std::cerr << "    --lookahead COUNT           : number of future images considered when encoding one. Default 0 (greedy).\n";
+    std::cerr << "    --age-half-life TICKS       : the priority of screen areas that stay wrong doubles every TICKS ticks. Default 0 (no aging).\n";
     std::cerr << "    --group BOOLEAN             : if true, packs ticks together to present screen updates at the same rate as the input media. Only works on a se30.\n";
     std::cerr << "    --bars BOOLEAN              : if false, image is zoomed in so there are no black bars.\n";
     std::cerr << "    --dither DITHER             : specifies the type of dithering to be used.\n";
@@ -158,12 +168,22 @@ void usage(const std::string name) {
     std::cerr << "    --error-bidi BOOLEAN        : if true, error diffusion is applied in different direction for even and odd scanlines.\n";
     std::cerr << "    --error-bleed PERCENT       : how much error is moved from a pixel to the neighbours.\n";
     std::cerr << "    --filters FILTERS           : specifies a set of filters to be applied on image afgter resizing, but before dithering\n";
+    std::cerr << "    --importance BOOLEAN        : if true, codecs spend their budget on details, the centre of the screen and subtitles first.\n";
+    std::cerr << "    --tile-threshold FLOAT      : 32x32 tiles of the source that changed less than that on average keep their previous dithering.\n";
+    std::cerr << "      Default 0 (every image is fully dithered).\n";
+    std::cerr << "    --dedupe BOOLEAN            : if true, source images identical to the previous one are not dithered again,\n";
+    std::cerr << "      their ticks are used to converge to the previous image.\n";
+    std::cerr << "    --motion BOOLEAN            : if true, the dither pattern follows pans of the source that the scroll codec can replay\n";
+    std::cerr << "      (whole bytes horizontally). Only used with --tile-threshold, as kept tiles move with the pan.\n";
     std::cerr << "    --codec CODEC               : adds a specific codec to the encoding. The first --codec parameter clears the profile codec list\n";
 
     std::cerr << "\n  Misc options:\n";
     std::cerr << "    --watermark STRING          : adds the string to the upper left corner of the generated flim for identification purposes.\n";
     std::cerr << "      use 'auto' to use the encoding parameters as watermark\n";
     std::cerr << "    --debug BOOLEAN             : enables various debug options\n";
+    std::cerr << "    --stats FILE                : writes per frame encoding statistics (codec, size, budget, bucket level, quality, scene cut, duplicate) as csv,\n";
+    std::cerr << "      and logs the time from startup to the first written frame\n";
+    std::cerr << "    --verify BOOLEAN            : if true, every written frame is decoded on a side thread and checked against what the encoder expects on screen\n";
 
     std::cerr << "\nList of profiles names for the --profile option (default 'se30'):\n";
     for (auto n : { "128k", "512k", "xl", "plus", "se", "portable", "se30", "perfect" }) {
@@ -217,6 +237,9 @@ int main(int argc, char **argv) {
         std::string diff_pattern = "";
         std::string change_pattern = "";
         std::string target_pattern = "";
+        std::string stats_file = "";
+        bool verify = false;
+        size_t target_size = 0;
         bool auto_watermark = false;
         std::string cache_file = std::tmpnam(nullptr);
         bool generated_cache = true;
@@ -331,6 +354,14 @@ int main(int argc, char **argv) {
                 argc--;
                 argv++;
                 custom_profile.set_byterate(atoi(*argv));
+            } else if (!strcmp(*argv, "--target-size")) {
+                argc--;
+                argv++;
+                target_size = atol(*argv);
+            } else if (!strcmp(*argv, "--vbr-depth")) {
+                argc--;
+                argv++;
+                custom_profile.set_vbr_depth(atoi(*argv));
             } else if (!strcmp(*argv, "--fps")) {
                 argc--;
                 argv++;
@@ -339,6 +370,18 @@ int main(int argc, char **argv) {
                 argc--;
                 argv++;
                 custom_profile.set_fps_ratio(atoi(*argv));
+            } else if (!strcmp(*argv, "--drop-threshold")) {
+                argc--;
+                argv++;
+                custom_profile.set_drop_threshold(atof(*argv));
+            } else if (!strcmp(*argv, "--lookahead")) {
+                argc--;
+                argv++;
+                custom_profile.set_lookahead(atoi(*argv));
+            } else if (!strcmp(*argv, "--age-half-life")) {
+                argc--;
+                argv++;
+                custom_profile.set_age_half_life(atof(*argv));
             } else if (!strcmp(*argv, "--group")) {
                 argc--;
                 argv++;
@@ -400,6 +443,14 @@ int main(int argc, char **argv) {
                 argc--;
                 argv++;
                 target_pattern = *argv;
+            } else if (!strcmp(*argv, "--stats")) {
+                argc--;
+                argv++;
+                stats_file = *argv;
+            } else if (!strcmp(*argv, "--verify")) {
+                argc--;
+                argv++;
+                verify = bool_from(*argv);
             } else if (!strcmp(*argv, "--comment")) {
                 argc--;
                 argv++;
@@ -445,6 +496,22 @@ int main(int argc, char **argv) {
                 argc--;
                 argv++;
                 custom_profile.set_error_bidi(bool_from(*argv));
+            } else if (!strcmp(*argv, "--importance")) {
+                argc--;
+                argv++;
+                custom_profile.set_importance(bool_from(*argv));
+            } else if (!strcmp(*argv, "--tile-threshold")) {
+                argc--;
+                argv++;
+                custom_profile.set_tile_threshold(atof(*argv));
+            } else if (!strcmp(*argv, "--dedupe")) {
+                argc--;
+                argv++;
+                custom_profile.set_dedupe(bool_from(*argv));
+            } else if (!strcmp(*argv, "--motion")) {
+                argc--;
+                argv++;
+                custom_profile.set_motion(bool_from(*argv));
             } else if (!strcmp(*argv, "--silent")) {
                 argc--;
                 argv++;
@@ -527,7 +594,7 @@ int main(int argc, char **argv) {
             std::clog << "( use --fps and --audio to change fps and audio )\n";
             r = std::make_unique<filesystem_reader>(input_file, fps, audio_arg, from_index, to_index);
         } else {
-            r = std::make_unique<ffmpeg_reader>(input_file, from_index, duration);
+            r = std::make_unique<ffmpeg_reader>(input_file, from_index, duration, custom_profile.motion());
             fps = r->frame_rate();
         }
 
@@ -546,6 +613,9 @@ int main(int argc, char **argv) {
         encoder.set_diff_pattern(diff_pattern);
         encoder.set_change_pattern(change_pattern);
         encoder.set_target_pattern(target_pattern);
+        encoder.set_stats_file(stats_file);
+        encoder.set_verify(verify);
+        encoder.set_target_size(target_size);
         encoder.set_poster_ts(poster_ts);
         encoder.set_subtitles(subs);
 
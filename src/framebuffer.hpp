@@ -4,6 +4,8 @@
 #include <vector>
 #include "image.hpp"
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <bit>
 
 
@@ -201,6 +203,14 @@ public:
     size_t W() const { return W_; }
     size_t H() const { return H_; }
 
+        //  Direct access to the 32 pixels words, in natural (horizontal) order
+    uint32_t word( size_t offset ) const { return value_from_bytes_be<uint32_t>( std::begin(data_)+offset*4 ); }
+    void set_word( size_t offset, uint32_t v ) { copy_from_value_be( std::begin(data_)+offset*4, v ); }
+
+        //  Value at column x (in units of T) and line y
+    template <typename T>
+    T value( size_t x, size_t y ) const { return value_from_bytes_be<T>( std::begin(data_)+y*get_rowbytes()+x*sizeof(T) ); }
+
     template <typename T>
     std::vector<T> raw_vertical() const
     {
@@ -270,6 +280,19 @@ public:
         return (*this ^ other).pixel_count();
     }
 
+        //  Number of different pixels, for each line
+    std::vector<size_t> line_differences( const framebuffer &other ) const
+    {
+        assert_size( other );
+        std::vector<size_t> res( H_ );
+        auto p = std::begin(data_);
+        auto q = std::begin(other.data_);
+        for (auto &count:res)
+            for (size_t x=0;x!=get_rowbytes();x++)
+                count += mypopcount( *p++ ^ *q++ );
+        return res;
+    }
+
     double proximity( const framebuffer &other ) const
     {
         return 1-(count_differences( other )/(double)(W_*H_));
@@ -296,6 +319,39 @@ public:
         memcpy( data_.data()+from*get_rowbytes(), other.data_.data()+from*get_rowbytes(), count*get_rowbytes() );
     }
 
+        //  Lines [from,from+count) get the content of the lines dy above them (below if dy<0),
+        //  moved right by dx bytes (left if dx<0). The bytes uncovered by the horizontal move are kept
+    void scroll_lines( size_t from, size_t count, int dy, int dx )
+    {
+        assert( from+count<=H_ );
+        assert( (int)from-dy>=0 && (int)(from+count)-dy<=(int)H_ );
+        assert( (size_t)std::abs( dx )<get_rowbytes() );
+
+        size_t rowbytes = get_rowbytes();
+        std::vector<uint8_t> source( std::begin(data_)+(from-dy)*rowbytes, std::begin(data_)+(from-dy+count)*rowbytes );
+        size_t len = rowbytes-std::abs( dx );
+        for (size_t i=0;i!=count;i++)
+            memcpy( data_.data()+(from+i)*rowbytes+std::max( dx, 0 ), source.data()+i*rowbytes+std::max( -dx, 0 ), len );
+    }
+
+        //  Bytes of line y
+    const uint8_t *line( size_t y ) const { return data_.data()+y*get_rowbytes(); }
+
+        //  Xors count bytes, from the byte at offset (in screen order), with the bytes of data
+    void xor_bytes( size_t offset, const uint8_t *data, size_t count )
+    {
+        assert( offset+count<=data_.size() );
+        for (size_t i=0;i!=count;i++)
+            data_[offset+i] ^= data[i];
+    }
+
+        //  Replaces count lines, starting at from, with the bytes of data
+    void set_lines( size_t from, size_t count, const uint8_t *data )
+    {
+        assert( from+count<=H_ );
+        memcpy( data_.data()+from*get_rowbytes(), data, count*get_rowbytes() );
+    }
+
     template <typename T>
     void extract( T out, size_t x, size_t y, size_t bytelen ) const
     {
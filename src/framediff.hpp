@@ -0,0 +1,278 @@
+#ifndef FRAMEDIFF_INCLUDED__
+#define FRAMEDIFF_INCLUDED__
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "framebuffer.hpp"
+
+/// How much each 32 pixels word (in natural order) is worth updating, 1 being normal
+/// An empty vector means that all words are equally important
+using word_weights = std::vector<float>;
+
+/**
+ * A sparse list of 32 pixels words written by a codec
+ * Candidates are scored from their patch, and only the winning one is applied to the screen
+ */
+class frame_patch
+{
+public:
+    struct entry
+    {
+        size_t offset;      //  Natural offset of the 32 pixels word
+        uint32_t value;     //  New pixels
+        uint32_t mask;      //  Pixels actually written
+    };
+
+private:
+    size_t width32_;                    //  Width in 32 pixels words
+    std::vector<entry> entries_;
+    bool sorted_ = true;                //  Entries are in increasing offset order, without duplicates
+
+public:
+    frame_patch( size_t W ) : width32_{ W/32 } {}
+
+    void set_word( size_t offset, uint32_t value, uint32_t mask=0xffffffff )
+    {
+        if (!entries_.empty() && entries_.back().offset>=offset)
+            sorted_ = false;
+        entries_.push_back( { offset, value, mask } );
+    }
+
+        /// Value at column x (in units of T) and line y
+    template <typename T>
+    void set( size_t x, size_t y, T value )
+    {
+        constexpr size_t per_word = 4/sizeof(T);
+        size_t shift = (per_word-1-x%per_word)*sizeof(T)*8;
+        set_word( y*width32_+x/per_word, (uint32_t)value<<shift, (uint32_t)(T)~(T)0<<shift );
+    }
+
+        /// Sorts the entries and merges the ones touching the same word (ie: two halves from z16)
+    const frame_patch &merged()
+    {
+        if (!sorted_)
+        {
+            std::stable_sort( std::begin(entries_), std::end(entries_), []( auto &a, auto &b ){ return a.offset<b.offset; } );
+
+            std::vector<entry> res;
+            for (auto &e:entries_)
+                if (!res.empty() && res.back().offset==e.offset)
+                {
+                    res.back().value = (res.back().value & ~e.mask) | (e.value & e.mask);
+                    res.back().mask |= e.mask;
+                }
+                else
+                    res.push_back( e );
+            entries_ = std::move( res );
+            sorted_ = true;
+        }
+        return *this;
+    }
+
+    const std::vector<entry> &entries() const { return entries_; }
+    size_t size() const { return entries_.size(); }
+
+    static uint32_t patched( uint32_t before, const entry &e ) { return (before & ~e.mask) | (e.value & e.mask); }
+
+    void apply( framebuffer &fb ) const
+    {
+        for (auto &e:entries_)
+            fb.set_word( e.offset, patched( fb.word( e.offset ), e ) );
+    }
+};
+
+/**
+ * What changed between the framebuffer on screen and the one we try to display
+ * Computed once per tick and shared by all the codecs, so they can skip the clean regions
+ */
+class frame_diff
+{
+    size_t W_;                          //  Width in pixels
+    size_t H_;                          //  Height in pixels
+
+    std::vector<uint32_t> xor_;         //  current^target, by 32 pixels words, in natural order
+    std::vector<size_t> line_counts_;   //  Number of different pixels in each line
+    std::vector<size_t> strip_counts_;  //  Number of different pixels in each 32 pixels wide column strip
+    std::vector<size_t> strip_begin_;   //  First different line in each strip (H_ if clean)
+    std::vector<size_t> strip_end_;     //  One past the last different line in each strip (0 if clean)
+    size_t changed_ = 0;                //  Total number of different pixels
+
+    size_t x0_, y0_, x1_, y1_;          //  Dirty bounding box, in words and lines
+
+    size_t target_id_;                  //  Unique for each target, so codecs can keep state between ticks
+    size_t revision_ = 0;               //  Number of patches applied since creation
+    std::vector<size_t> updated_;       //  Words changed by the last applied patch
+
+    static size_t next_target_id()
+    {
+        static size_t id = 0;
+        return ++id;
+    }
+
+public:
+    frame_diff( const framebuffer &current, const framebuffer &target ) :
+            W_{ current.W() },
+            H_{ current.H() },
+            xor_( W_/32*H_ ),
+            line_counts_( H_ ),
+            strip_counts_( W_/32 ),
+            strip_begin_( W_/32, H_ ),
+            strip_end_( W_/32, 0 ),
+            target_id_{ next_target_id() }
+    {
+        assert( W_==target.W() && H_==target.H() );
+
+        auto p = std::begin(xor_);
+        for (size_t y=0;y!=H_;y++)
+            for (size_t x=0;x!=width32();x++)
+            {
+                size_t offset = y*width32()+x;
+                uint32_t v = current.word( offset ) ^ target.word( offset );
+                *p++ = v;
+                if (v)
+                {
+                    size_t count = mypopcount( v );
+                    line_counts_[y] += count;
+                    strip_counts_[x] += count;
+                    changed_ += count;
+                    strip_begin_[x] = std::min( strip_begin_[x], y );
+                    strip_end_[x] = y+1;
+                }
+            }
+
+        compute_bounding_box();
+    }
+
+    size_t W() const { return W_; }
+    size_t H() const { return H_; }
+
+        /// Width in 32 pixels words
+    size_t width32() const { return W_/32; }
+
+        /// Difference of the 32 pixels at the given natural offset
+    uint32_t xor_word( size_t offset ) const { return xor_[offset]; }
+    uint32_t xor_word( size_t x, size_t y ) const { return xor_[y*width32()+x]; }
+
+    const std::vector<size_t> &line_counts() const { return line_counts_; }
+    const std::vector<size_t> &strip_counts() const { return strip_counts_; }
+
+        /// Dirty vertical extent of the x-th 32 pixels strip (empty if begin>=end)
+    size_t strip_begin( size_t x ) const { return strip_begin_[x]; }
+    size_t strip_end( size_t x ) const { return strip_end_[x]; }
+
+    size_t changed() const { return changed_; }
+    size_t pixel_count() const { return W_*H_; }
+    double changed_fraction() const { return changed_/(double)pixel_count(); }
+    bool clean() const { return changed_==0; }
+
+        /// Number of different pixels once the (merged) patch is applied on current
+    size_t changed_after( const framebuffer &current, const frame_patch &patch ) const
+    {
+        size_t count = changed_;
+        for (auto &e:patch.entries())
+        {
+            uint32_t before = current.word( e.offset );
+            count -= mypopcount( xor_[e.offset] );
+            count += mypopcount( frame_patch::patched( before, e ) ^ before ^ xor_[e.offset] );
+        }
+        return count;
+    }
+
+        /// Proximity of a screen that still has count different pixels
+    double proximity_for( size_t count ) const
+    {
+        return 1-(count/(double)pixel_count());
+    }
+
+        /// Same as framebuffer::proximity, without building the patched framebuffer
+    double proximity_after( const framebuffer &current, const frame_patch &patch ) const
+    {
+        return proximity_for( changed_after( current, patch ) );
+    }
+
+        /// Updates the difference when patch is drawn on current (which must not have been patched yet)
+        /// Only the patched words are looked at, so the diff can be kept across the ticks of an image
+    void apply( const framebuffer &current, const frame_patch &patch )
+    {
+        updated_.clear();
+        std::vector<bool> touched( width32() );
+
+        for (auto &e:patch.entries())
+        {
+            uint32_t before = current.word( e.offset );
+            uint32_t v = frame_patch::patched( before, e ) ^ before ^ xor_[e.offset];
+            if (v==xor_[e.offset])
+                continue;
+
+            size_t x = e.offset%width32();
+            size_t y = e.offset/width32();
+            size_t old_count = mypopcount( xor_[e.offset] );
+            size_t count = mypopcount( v );
+
+            line_counts_[y] += count-old_count;
+            strip_counts_[x] += count-old_count;
+            changed_ += count-old_count;
+            if (v)
+            {
+                strip_begin_[x] = std::min( strip_begin_[x], y );
+                strip_end_[x] = std::max( strip_end_[x], y+1 );
+            }
+
+            xor_[e.offset] = v;
+            updated_.push_back( e.offset );
+            touched[x] = true;
+        }
+
+            //  Shrink the dirty extent of the strips that got cleaner
+        for (size_t x=0;x!=width32();x++)
+            if (touched[x])
+            {
+                if (strip_counts_[x]==0)
+                {
+                    strip_begin_[x] = H_;
+                    strip_end_[x] = 0;
+                    continue;
+                }
+                while (!xor_word( x, strip_begin_[x] ))
+                    strip_begin_[x]++;
+                while (!xor_word( x, strip_end_[x]-1 ))
+                    strip_end_[x]--;
+            }
+
+        compute_bounding_box();
+        revision_++;
+    }
+
+    size_t target_id() const { return target_id_; }
+    size_t revision() const { return revision_; }
+
+        /// Natural offsets of the words changed by the last apply()
+    const std::vector<size_t> &updated() const { return updated_; }
+
+        /// Dirty bounding box, words in [x0,x1), lines in [y0,y1)
+    size_t x0() const { return x0_; }
+    size_t y0() const { return y0_; }
+    size_t x1() const { return x1_; }
+    size_t y1() const { return y1_; }
+
+private:
+    void compute_bounding_box()
+    {
+        x0_ = width32(); x1_ = 0;
+        y0_ = H_; y1_ = 0;
+        for (size_t x=0;x!=width32();x++)
+            if (strip_counts_[x])
+            {
+                x0_ = std::min( x0_, x );
+                x1_ = x+1;
+                y0_ = std::min( y0_, strip_begin_[x] );
+                y1_ = std::max( y1_, strip_end_[x] );
+            }
+        if (x0_>x1_)
+            x0_ = x1_ = y0_ = y1_ = 0;
+    }
+};
+
+#endif
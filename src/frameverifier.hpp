@@ -0,0 +1,125 @@
+#ifndef FRAMEVERIFIER_INCLUDED__
+#define FRAMEVERIFIER_INCLUDED__
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <string>
+#include <sstream>
+
+#include "framebuffer.hpp"
+#include "decoder.hpp"
+
+/**
+ * Decodes the frames written in the flim, on a side thread, and checks that the screen
+ * is exactly what the encoder thinks it is (the 'result' of the frame)
+ * Decoding is much faster than encoding, so this does not slow the encode down
+ */
+class frame_verifier
+{
+    struct pending_frame
+    {
+        std::vector<uint8_t> video;
+        framebuffer result;
+    };
+
+    flim_decoder decoder_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<pending_frame> queue_;
+    bool done_ = false;
+
+    size_t checked_ = 0;            //  Frames decoded by the side thread
+    std::string error_;             //  First failure, empty if none
+
+    std::thread thread_;
+
+    void run()
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lock( mutex_ );
+            ready_.wait( lock, [this]{ return done_ || !queue_.empty(); } );
+            if (queue_.empty())
+                return;
+            pending_frame f = std::move( queue_.front() );
+            queue_.pop_front();
+            bool failed = !error_.empty();
+            lock.unlock();
+
+            if (failed)
+                continue;
+
+            std::string error;
+            try
+            {
+                decoder_.decode( f.video );
+                if (!(decoder_.screen()==f.result))
+                {
+                    std::ostringstream s;
+                    s << "codec 0x" << std::hex << (int)f.video[3] << std::dec << " leaves " << decoder_.screen().count_differences( f.result ) << " pixels different from the encoder";
+                    error = s.str();
+                }
+            }
+            catch (const char *e)
+            {
+                error = e;
+            }
+
+            lock.lock();
+            if (!error.empty())
+                error_ = "Frame " + std::to_string( checked_ ) + ": " + error;
+            checked_++;
+        }
+    }
+
+        //  Stops the side thread once all the frames are decoded
+    void join()
+    {
+        if (!thread_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            done_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    void check() const
+    {
+        if (!error_.empty())
+        {
+            std::cerr << "Verification failed. " << error_ << "\n";
+            throw "Decoded flim does not match the encoder";
+        }
+    }
+
+public:
+    frame_verifier( const framebuffer &initial ) : decoder_{ initial }, thread_{ &frame_verifier::run, this } {}
+
+    ~frame_verifier() { join(); }
+
+        //  Queues a frame, throws if a previous frame failed
+    void push( const std::vector<uint8_t> &video, const framebuffer &result )
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            check();
+            queue_.push_back( { video, result } );
+        }
+        ready_.notify_one();
+    }
+
+        //  Waits for the last frames, throws if any of them failed, returns the number of frames checked
+    size_t finish()
+    {
+        join();
+        check();
+        return checked_;
+    }
+};
+
+#endif
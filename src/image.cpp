@@ -237,6 +237,85 @@ image black( const image &src, double percent )
     return res;
 }
 
+//  ------------------------------------------------------------------
+//  Temporal denoise: pixels that did not move are averaged with the
+//  previous source images, so grain does not flip dithered pixels.
+//  Pixels that changed more than threshold are kept as is (no ghosting)
+//  ------------------------------------------------------------------
+image denoise( const image &src, filter_state *state, double threshold )
+{
+    if (!state)
+        return src;     //  Nothing to average with
+
+    const size_t size = src.W()*src.H();
+    auto &ring = state->ring;
+    if (!ring.empty() && ring.front().size()!=size)
+        ring.clear();
+
+    image res = src;
+    const float *p = src.image_.data();
+    float *q = res.image_.data();
+
+    if (!ring.empty())
+    {
+        std::vector<uint16_t> sum( size );
+        for (auto &past:ring)
+        {
+            const uint8_t *r = past.data();
+            for (size_t i=0;i!=size;i++)
+                sum[i] += r[i];
+        }
+
+        const float n = ring.size();
+        const float scale = 1/(255*n);
+
+            //  Difference with the average, smoothed over 3x3 pixels so that grain cancels out but motion does not
+            //  On the borders, only the neighbours inside the image are averaged
+        const size_t W = src.W();
+        const size_t H = src.H();
+        std::vector<float> difference( size );
+        for (size_t i=0;i!=size;i++)
+            difference[i] = p[i]-sum[i]*scale;
+        auto neighbours = []( size_t i, size_t n ) { return (i>0)+1+(i+1<n); };
+        std::vector<float> smoothed( size );
+        for (size_t y=0;y!=H;y++)
+        {
+            const float *d = difference.data()+y*W;
+            float *s = smoothed.data()+y*W;
+            for (size_t x=0;x!=W;x++)
+                s[x] = ((x>0?d[x-1]:0)+d[x]+(x+1<W?d[x+1]:0))/neighbours( x, W );
+        }
+        for (size_t y=0;y!=H;y++)
+        {
+            const float *s = smoothed.data()+y*W;
+            float *d = difference.data()+y*W;
+            for (size_t x=0;x!=W;x++)
+                d[x] = ((y>0?s[x-W]:0)+s[x]+(y+1<H?s[x+W]:0))/neighbours( y, H );
+        }
+
+        const float t = threshold;
+        for (size_t i=0;i!=size;i++)
+        {
+            float average = sum[i]*scale;
+            float blended = (p[i]+average*n)/(n+1);
+            q[i] = std::abs( difference[i] )<t?blended:p[i];
+        }
+    }
+
+    //  The source goes in the ring, not the result, so moving pixels are not smeared
+    std::vector<uint8_t> past( size );
+    for (size_t i=0;i!=size;i++)
+        past[i] = std::clamp( p[i], 0.0f, 1.0f )*255+0.5f;
+
+    if (ring.size()<filter_state::Depth)
+        ring.push_back( std::move( past ) );
+    else
+        ring[state->next] = std::move( past );
+    state->next = (state->next+1)%filter_state::Depth;
+
+    return res;
+}
+
 //  ------------------------------------------------------------------
 //  Removes all a precentage of white pixels, scales the rest
 //  ------------------------------------------------------------------
@@ -411,10 +490,11 @@ typedef enum
     kInvert = 'i',
     kBlack = 'k',           //  Remove the darkest x%
     kWhite = 'w',           //  Remove the whitest x%
+    kDenoise = 'd',         //  Temporal denoise of changes under x/255
     kDebug = '@'
 }   eFilters;
 
-image filter( const image &from, eFilters filter, double arg=0 )
+image filter( const image &from, eFilters filter, double arg=0, filter_state *state=nullptr )
 {
     switch (filter)
     {
@@ -446,6 +526,8 @@ image filter( const image &from, eFilters filter, double arg=0 )
             return black( from, arg?arg:1/16.0 );
         case kWhite:
             return white( from, arg?arg:1/16.0 );
+        case kDenoise:
+            return denoise( from, state, (arg?arg:12)/255 );
         case kDebug:
             return debug_filter( from );
     }
@@ -487,14 +569,14 @@ inline bool extract_filter( const char *&p, char &f, double &arg )
 //  Apply a sequence of filters
 //  ------------------------------------------------------------------
 
-image filter( const image &from, const char *filters )
+image filter( const image &from, const char *filters, filter_state *state )
 {
     image res = from;
     char f;
     double arg;
 
     while (extract_filter( filters, f, arg ))
-        res = filter( res, (eFilters)f, arg );
+        res = filter( res, (eFilters)f, arg, state );
 
     return res;
 }
@@ -878,8 +960,23 @@ void old_quantize( image &dest, const image &source, const image &previous, floa
 //  while trying to respect the placement of pixels
 //  from the black/white 'previous' image
 //  ------------------------------------------------------------------
-void error_diffusion( image &dest, const image &source, const image &previous, float stability, const dither_algorithm &algo, float bleed, bool two_ways )
+//  Pixels of the keep tiles are not dithered again, but copied from previous
+//  errors holds the error each pixel made when it was last dithered, and is updated for the dithered ones
+//  Kept tiles are skipped: only their pixels that can reach another tile send their stored error,
+//  so the changed tiles see about the same error at their borders as if the kept ones had been dithered
+void error_diffusion( image &dest, const image &source, const image &previous, float stability, const dither_algorithm &algo, float bleed, bool two_ways, const std::vector<bool> &keep, size_t tile_size, image *errors )
 {
+    size_t tiles_width = (source.W()+tile_size-1)/tile_size;
+
+        //  How far the error goes, which gives the border of the kept tiles that must still send it
+    size_t reach_x = 0;
+    size_t reach_y = 0;
+    for (auto &t:algo.targets)
+    {
+        reach_x = std::max( reach_x, (size_t)std::abs( t.dx ) );
+        reach_y = std::max( reach_y, (size_t)t.dy );
+    }
+
     // old_quantize( dest, source, previous, stability );
 
     // return;
@@ -887,7 +984,19 @@ void error_diffusion( image &dest, const image &source, const image &previous, f
     dest = source;
 
     int dir = 1;
-    
+
+    auto diffuse = [&]( size_t x, size_t y, float error )
+    {
+        for (auto &t:algo.targets)
+        {
+            float e = error * t.amount;
+            size_t tx = x+t.dx*dir;
+            size_t ty = y+t.dy;
+            if (tx < source.W() && ty < source.H())
+                dest.at(tx,ty) = dest.at(tx,ty) + e;
+        }
+    };
+
     for (size_t y=0;y!=source.H();y++)
     {
         size_t beginx = 0;
@@ -899,8 +1008,37 @@ void error_diffusion( image &dest, const image &source, const image &previous, f
             endx = -1;
         }
 
+        const bool bottom = y%tile_size+reach_y>=tile_size;     //  The error of this line goes to the tiles below
+
         for (size_t x=beginx;x!=endx;x+=dir)
         {
+            if (!keep.empty() && keep[y/tile_size*tiles_width+x/tile_size])
+            {
+                    //  The part of the line in this tile
+                size_t from = x/tile_size*tile_size;
+                size_t to = std::min( from+tile_size, source.W() );
+
+                if (errors)
+                {
+                    size_t first = dir==1?from:to-1;
+                    for (size_t i=0;i!=to-from;i++)
+                    {
+                            //  Away from the bottom, the error of the inside of the tile stays in the tile
+                        if (!bottom && i==reach_x && to-from>2*reach_x)
+                            i = to-from-reach_x;
+                        size_t px = first+i*dir;
+                        diffuse( px, y, errors->at( px, y ) );
+                    }
+                }
+
+                    //  After the diffusion, which also went into this part of the line
+                std::copy( &previous.at( from, y ), &previous.at( from, y )+(to-from), &dest.at( from, y ) );
+
+                    //  Next pixel is the first one after the tile, in scan order
+                x = dir==1?to-1:from;
+                continue;
+            }
+
             //  The color we'd like this pixel to be
             float source_color = dest.at(x,y);
 
@@ -923,18 +1061,13 @@ void error_diffusion( image &dest, const image &source, const image &previous, f
             //  We reduce bleed (can also be encoded in the quantization matrix)
             error *= bleed;
 
+            if (errors)
+                errors->at(x,y) = error;
+
             //  We now distribute the error between the next values, according to the selected algorith
             //  (if they exist). The values may over or underflow
             //  but it is fine as pixels can be <0 or >1
-
-            for (auto &t:algo.targets)
-            {
-                float e = error * t.amount;
-                size_t tx = x+t.dx*dir;
-                size_t ty = y+t.dy;
-                if (tx < source.W() && ty < source.H())
-                    dest.at(tx,ty) = dest.at(tx,ty) + e;
-            }
+            diffuse( x, y, error );
         }
 
         if (two_ways)
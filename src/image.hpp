@@ -11,7 +11,7 @@
 #include <algorithm>
 
 /// Alternate implementaiton of std::popcount, to support non compliant C++20 compilers (MacOS 10.15)
-inline int mypopcount( unsigned n )
+constexpr int mypopcount( unsigned n )
 {
     int count = 0;
     while (n) {
@@ -73,16 +73,36 @@ public:
     }
 };
 
+//  Motion of a block of an image since the previous one, as decoded from the video stream
+//  Coordinates are fractions of the image width and height, so they do not depend on resizing
+struct motion_vector
+{
+    float x, y;         //  Top left of the block in the current image
+    float w, h;         //  Size of the block
+    float dx, dy;       //  Displacement of the block since the previous image
+};
+
+using motion_field = std::vector<motion_vector>;
+
 void fill( image &img, float value = 0.5 );
 image round_corners( const image& img );
-image filter( const image &from, const char *filters );
+//  What temporal filters remember from the previous images
+//  Without a state, temporal filters do nothing
+struct filter_state
+{
+    static const size_t Depth = 8;
+    std::vector<std::vector<uint8_t>> ring;     //  Last source images, 8 bits per pixel
+    size_t next = 0;                            //  Next ring entry to replace
+};
+
+image filter( const image &from, const char *filters, filter_state *state=nullptr );
 void ordered_dither( image &dest, const image &source, const image &previous );
 
 struct dither_algorithm;
 
 const dither_algorithm *get_error_diffusion_by_name( const std::string &name );
 void error_diffusion_algorithms( std::function<void(const std::string name, const std::string desciption)> f );
-void error_diffusion( image &dest, const image &source, const image &previous, float stability, const dither_algorithm &algo, float bleed=1, bool two_ways=false );
+void error_diffusion( image &dest, const image &source, const image &previous, float stability, const dither_algorithm &algo, float bleed=1, bool two_ways=false, const std::vector<bool> &keep={}, size_t tile_size=32, image *errors=nullptr );
 
 bool read_image( image &result, const char *file );
 void write_image( const char *file, const image &img );
@@ -139,13 +139,14 @@ inline std::vector<run<T>> pack(
     std::vector<bool>::const_iterator pack_end,     //  (offset_t does the automatic conversion, so we scan in vertical order)
     size_t max_pack_bytes,
     size_t width,
-    size_t height
+    size_t height,
+    size_t header_size = kHeaderSize                //  Size of the run headers and of the end marker
         )
 {
     std::vector<run<T>> output_buffer;
     offset_t offset{ width, height };
 
-    size_t total_bytes = kHeaderSize; //  end-marker
+    size_t total_bytes = header_size; //  end-marker
 
     while (pack_begin<pack_end)
     {
@@ -164,20 +165,21 @@ inline std::vector<run<T>> pack(
         size_t non_zero_count = 0;
         while (pack_begin<pack_end && *pack_begin)
         {
+                //  Stop before the element that would not fit
+            if (total_bytes+header_size+sizeof(T)*(non_zero_count+1)>max_pack_bytes)
+                break;
+
             non_zero_count++;
             ++pack_begin;
 
             if (offset.increment())
                 break;
-
-            if (total_bytes+kHeaderSize+sizeof(T)*non_zero_count>=max_pack_bytes)
-                break;
         }
 
-        if (non_zero_count==0)      //  Don't skip at the end if nothing needs to be copied
+        if (non_zero_count==0)      //  Don't skip at the end if nothing needs to be copied (or nothing fits)
             break;
 
-        total_bytes += kHeaderSize + sizeof(T)*non_zero_count;
+        total_bytes += header_size + sizeof(T)*non_zero_count;
 
         while (non_zero_count--)
             run.data.push_back( *data++ );
@@ -330,7 +332,7 @@ public:
 
     size_t size() const
     {
-        if (byte_size_>header_cost_+N*elem_cost_)
+        if (byte_size_>header_cost_*2+N*elem_cost_)
         {
             std::cerr << "Byte size  : " << byte_size_ << "\n";
             std::cerr << "Header Cost: " << header_cost_ << "\n";
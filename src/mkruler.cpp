@@ -0,0 +1,98 @@
+/**
+ * Generates the byte distance table used by uint8_ruler (ruler_table.hpp)
+ *
+ * The distance between two bytes is the cost of the cheapest series of
+ * transformations from one to the other, where swapping two adjacent
+ * different pixels costs 1 and flipping a single pixel costs 2.
+ *
+ * This used to be computed at startup, but it is an O(256^3) relaxation,
+ * so we now do it once at build time.
+ */
+
+#include <bitset>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+
+static size_t distance_[256][256];
+static bool known_[256][256];
+
+static bool set_distance( int n0, int n1, size_t v )
+{
+    if (v>=distance_[n0][n1])
+        return false;
+
+    distance_[n0][n1] = distance_[n1][n0] = v;
+    known_[n0][n1] = known_[n1][n0] = true;
+
+    return true;
+}
+
+static void set_distance( int n0, std::bitset<8> n1, size_t v ) { set_distance( n0, (int)n1.to_ulong(), v ); }
+
+static void complete()
+{
+    bool work_needed = true;
+
+    while (work_needed)
+    {
+        work_needed = false;
+        for (int x=0;x!=256;x++)
+            for (int y=0;y!=256;y++)
+            {   for (int z=0;z!=256;z++)
+                    if (known_[x][z] && known_[y][z])
+                        work_needed |= set_distance( x, y, distance_[x][z]+distance_[z][y] );
+                work_needed |= !known_[x][y];
+            }
+    }
+}
+
+int main()
+{
+    for (int x=0;x!=256;x++)
+        for (int y=0;y!=256;y++)
+        {
+            distance_[x][y] = std::numeric_limits<size_t>::max();
+            known_[x][y] = false;
+        }
+
+    for (int n=0;n!=256;n++)
+    {
+        set_distance( n, n, 0 );
+
+        std::bitset<8> bin(n);
+
+        for (int b=0;b!=8;b++)
+        {
+            set_distance( n, bin.flip(b), 2 );
+            bin.flip(b);
+        }
+    }
+
+    for (int n=0;n!=256;n++)
+        for (int b=0;b!=7;b++)
+        {
+            std::bitset<8> bin(n);
+            if (bin[b]!=bin[b+1])
+            {
+                bin.flip(b);
+                bin.flip(b+1);
+                set_distance( n, bin, 1 );
+            }
+        }
+
+    complete();
+
+    printf( "//  Generated by mkruler -- do not edit\n" );
+    printf( "{\n" );
+    for (int x=0;x!=256;x++)
+    {
+        printf( "    {" );
+        for (int y=0;y!=256;y++)
+            printf( "%s%zu", y?",":"", distance_[x][y] );
+        printf( "},\n" );
+    }
+    printf( "}\n" );
+
+    return 0;
+}
@@ -79,6 +79,8 @@ void ffmpeg_reader::init_video_context() {
 
     AVDictionary *opts = NULL;
     av_dict_set(&opts, "refcounted_frames", "0", 0);    //  Do not refcount
+    if (export_motion_)
+        av_dict_set(&opts, "flags2", "+export_mvs", 0); //  Motion vectors, for motion compensated dithering
 
     if (avcodec_open2(video_codec_context_, video_decoder_, &opts) < 0) {
         throw "CANNOT OPEN VIDEO CODEC";
@@ -141,6 +143,12 @@ void ffmpeg_reader::decode_video(AVFrame* frame, AVPacket* pkt, AVFrame*& cloned
 
     if (avcodec_send_packet(video_codec_context_, pkt) == 0 && avcodec_receive_frame(video_codec_context_, frame) == 0) {
         cloned_frame = av_frame_clone(frame);
+        motion_field motion = export_motion_ ? motion_from(frame) : motion_field{};
+        if (frame->pict_type == AV_PICTURE_TYPE_I || frame->pict_type == AV_PICTURE_TYPE_P)
+            since_anchor_ = 0;
+        else
+            since_anchor_++;
+
         if (cloned_frame->pts * av_q2d(video_stream_->time_base) >= first_frame_second_) { //&& images_.size() <= video_frame_count) {
             #ifdef VERBOSE
             printf("video_frame%s n:%d coded_n:%d presentation_ts:%ld / %f\n",
@@ -158,6 +166,11 @@ void ffmpeg_reader::decode_video(AVFrame* frame, AVPacket* pkt, AVFrame*& cloned
 
             video_image_->set_luma(video_dst_data_[0]);
 
+            duplicates_.push_back(is_duplicate(video_dst_data_[0], video_dst_linesize_[0]));
+            motions_.push_back(std::move(motion));
+            if (duplicates_.back())
+                duplicate_count_++;
+
             images_.push_back(*default_image_);
             copy(images_.back(), *video_image_);
         }
@@ -169,6 +182,69 @@ void ffmpeg_reader::decode_video(AVFrame* frame, AVPacket* pkt, AVFrame*& cloned
     }
 }
 
+//  Compares a downscaled signature of the luma with the one of the previous image
+//  Averaging blocks absorbs the noise of re-encoded duplicates
+bool ffmpeg_reader::is_duplicate(const uint8_t *luma, int linesize) {
+    size_t W = video_codec_context_->width;
+    size_t H = video_codec_context_->height;
+    size_t SW = (W+SignatureBlock-1)/SignatureBlock;
+    size_t SH = (H+SignatureBlock-1)/SignatureBlock;
+
+    std::vector<uint32_t> sums(SW*SH);
+    std::vector<uint32_t> counts(SW*SH);
+    for (size_t y=0;y!=H;y++) {
+        const uint8_t *p = luma+y*linesize;
+        uint32_t *s = sums.data()+y/SignatureBlock*SW;
+        uint32_t *c = counts.data()+y/SignatureBlock*SW;
+        for (size_t x=0;x!=W;x++) {
+            s[x/SignatureBlock] += p[x];
+            c[x/SignatureBlock]++;
+        }
+    }
+
+    std::vector<uint8_t> signature(SW*SH);
+    for (size_t i=0;i!=signature.size();i++)
+        signature[i] = sums[i]/counts[i];
+
+    bool duplicate = signature_.size()==signature.size();
+    for (size_t i=0;duplicate && i!=signature.size();i++)
+        duplicate = std::abs(signature[i]-signature_[i])<=DuplicateTolerance;
+
+    //  Duplicates are compared to the last kept image, so slow fades are not lost
+    if (!duplicate)
+        signature_ = signature;
+    return duplicate;
+}
+
+//  The motion vectors exported by the decoder, for the blocks predicted from a past image
+//  Codecs without motion vectors (or intra images) give an empty field
+//  The past image of P and B images is the last I or P one, which is several images back when
+//  there are B images in between (IBBP...), so vectors are scaled down to one image
+motion_field ffmpeg_reader::motion_from(const AVFrame *frame) const {
+    motion_field motion;
+
+    const AVFrameSideData *side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+    if (!side_data)
+        return motion;
+
+    double W = video_codec_context_->width;
+    double H = video_codec_context_->height;
+    double distance = since_anchor_+1.0;
+    const AVMotionVector *mvs = (const AVMotionVector *)side_data->data;
+    size_t count = side_data->size/sizeof(AVMotionVector);
+    for (size_t i=0;i!=count;i++) {
+        const AVMotionVector &mv = mvs[i];
+        if (mv.source>=0 || (mv.src_x==mv.dst_x && mv.src_y==mv.dst_y))
+            continue;
+        motion.push_back({
+            (float)((mv.dst_x-mv.w/2)/W), (float)((mv.dst_y-mv.h/2)/H),
+            (float)(mv.w/W), (float)(mv.h/H),
+            (float)((mv.dst_x-mv.src_x)/W/distance), (float)((mv.dst_y-mv.src_y)/H/distance) });
+    }
+
+    return motion;
+}
+
 void ffmpeg_reader::decode_sound(AVFrame* frame, AVPacket* pkt, AVFrame*& cloned_frame) {
     if (avcodec_send_packet(audio_codec_context_, pkt) == 0 && avcodec_receive_frame(audio_codec_context_, frame) == 0) {
         cloned_frame = av_frame_clone(frame);
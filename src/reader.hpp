@@ -13,6 +13,7 @@ extern "C" {
     #include <libavutil/imgutils.h>
     #include <libavutil/samplefmt.h>
     #include <libavutil/timestamp.h>
+    #include <libavutil/motion_vector.h>
     #include <libavcodec/avcodec.h>
 }
 
@@ -264,6 +265,16 @@ class ffmpeg_reader : public input_reader {
     std::unique_ptr<image> video_image_;        //  Size of the video input
     std::unique_ptr<image> default_image_;      //  Size of our output
     std::deque<image> images_;                  //  Image read buffer
+    std::deque<bool> duplicates_;               //  For each image of the buffer, true if it is the same as the previous one
+    bool export_motion_ = false;                //  The decoder exports its motion vectors (only for motion compensated dithering)
+    std::deque<motion_field> motions_;          //  For each image of the buffer, the motion decoded from the stream
+    size_t since_anchor_ = 0;                   //  Images decoded since the last I or P image
+    motion_field motion_;                       //  Motion of the last extracted image
+    bool duplicate_ = false;                    //  The last extracted image is the same as the previous one
+    size_t duplicate_count_ = 0;                //  Number of duplicate images read
+    std::vector<uint8_t> signature_;            //  Average luma of 16x16 blocks of the last decoded image
+    static const size_t SignatureBlock = 16;
+    static const int DuplicateTolerance = 1;    //  Luma levels a block can change in a duplicate image
     std::unique_ptr<sound_buffer> sound_;
     int image_ix = -1;
     int sound_ix = -1;
@@ -279,6 +290,10 @@ class ffmpeg_reader : public input_reader {
 
     void init_reader(const std::string &movie_path, double &from, double &duration);
 
+    bool is_duplicate(const uint8_t *luma, int linesize);
+
+    motion_field motion_from(const AVFrame *frame) const;
+
     void read() {
         auto bufsize = av_image_alloc(
                 video_dst_data_,
@@ -315,7 +330,7 @@ class ffmpeg_reader : public input_reader {
 public:
     ffmpeg_reader() {}
 
-    ffmpeg_reader(const std::string &movie_path, double from, double duration) {
+    ffmpeg_reader(const std::string &movie_path, double from, double duration, bool export_motion = false) : export_motion_{export_motion} {
 
         init_reader(movie_path, from, duration);
 
@@ -346,6 +361,14 @@ public:
     size_t get_frames_to_extract() const {return frames_to_extract_;}
     size_t get_read_images() const {return video_frame_count;}
     size_t get_extracted_frames() const {return extracted_frames_;}
+    size_t get_duplicate_frames() const {return duplicate_count_;}
+
+        //  True if the last extracted image is identical (or nearly) to the one before
+        //  Telecined material, slideshows and animations on twos are full of these
+    bool last_frame_duplicate() const {return duplicate_;}
+
+        //  Block motion of the last extracted image, exported by the decoder (empty unless export_motion was set)
+    const motion_field &last_frame_motion() const {return motion_;}
 
     bool can_extract_frames(size_t num_of_ticks) {
         if(!images_.empty() && (frames_to_extract_ - extracted_frames_) < 2) {
@@ -374,6 +397,10 @@ public:
 
         image* image_ptr = new image(images_.front());
         images_.pop_front();
+        duplicate_ = duplicates_.front();
+        duplicates_.pop_front();
+        motion_ = std::move(motions_.front());
+        motions_.pop_front();
         extracted_frames_++;
 
         return image_ptr;
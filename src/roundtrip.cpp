@@ -0,0 +1,168 @@
+/**
+ * Round-trip check of the codecs (make check)
+ * Encodes a synthetic movie with each codec alone, decodes it with the reference decoders
+ * and compares the result with what the encoder believes is on screen
+ * Each movie is done twice, restarting the codecs in between, like a two-pass encode
+ */
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "image.hpp"
+#include "framebuffer.hpp"
+#include "imgcompress.hpp"
+#include "compressor.hpp"
+#include "decoder.hpp"
+
+// True if the global '-g' option was set
+bool sDebug = false;
+
+static const size_t W = 512;
+static const size_t H = 342;
+
+//  The next image of the synthetic movie
+//  The kind of change cycles, so every codec gets something it is made for
+framebuffer next_image( const framebuffer &previous, size_t n, std::mt19937 &rng )
+{
+    framebuffer fb = previous;
+    size_t width32 = W/32;
+
+    switch (n%5)
+    {
+        case 0:     //  Part of the screen moves
+            fb.scroll_lines( 10, 300, (int)(rng()%5)-2, (int)(rng()%3)-1 );
+            break;
+        case 1:     //  Tiles that come back
+            for (size_t ty=0;ty!=10;ty++)
+                for (size_t i=0;i!=8;i++)
+                    fb.set_word( (ty*8+8+i)*width32+3, 0x12345678u*(ty%3+1)+i );
+            break;
+        case 2:     //  A black rectangle
+            for (size_t y=100;y!=200;y++)
+                for (size_t x=2;x!=10;x++)
+                    fb.set_word( y*width32+x, 0 );
+            break;
+        case 3:     //  Noise on a third of the screen
+            for (size_t offset=0;offset!=width32*H;offset++)
+                if (rng()%3==0)
+                    fb.set_word( offset, rng() );
+            break;
+        case 4:     //  Flash
+            fb.invert();
+            break;
+    }
+
+        //  And a few random words
+    for (size_t i=rng()%20;i!=0;i--)
+        fb.set_word( rng()%(width32*H), rng() );
+
+    return fb;
+}
+
+//  A codec that the player decodes, with its signature (as in flimcompressor::make_codec)
+struct codec
+{
+    std::string name;
+    uint8_t signature;
+    std::shared_ptr<compressor> coder;
+};
+
+//  Encodes the movie with one codec, returns the number of failures
+size_t check_codec( const codec &codec )
+{
+    const std::string &name = codec.name;
+    size_t failures = 0;
+
+    for (int pass=0;pass!=2;pass++)
+    {
+        codec.coder->restart();
+
+        std::mt19937 rng( 1 );
+        framebuffer initial( W, H );
+        initial.fill( 0xff );
+        framebuffer current = initial;
+        framebuffer target = initial;
+        flim_decoder decoder( initial );
+        size_t frames = 0;
+        size_t mismatches = 0;
+        size_t over_budget = 0;
+
+        for (size_t n=0;n!=60;n++)
+        {
+            target = next_image( target, n, rng );
+            for (size_t tick=0;tick!=3;tick++)
+            {
+                const size_t budgets[] = { 300, 3001, 30002 };
+                size_t budget = budgets[(n+tick)%3];
+
+                frame_diff diff{ current, target };
+                frame_patch patch{ W };
+                auto data = static_cast<const compressor &>( *codec.coder ).compress( patch, current, target, diff, {}, budget );
+                if (data.size()>budget)
+                    over_budget++;
+
+                    //  Sometimes a later candidate of the same codec is not the one displayed
+                if (n%4==0)
+                {
+                    frame_patch unused{ W };
+                    static_cast<const compressor &>( *codec.coder ).compress( unused, current, target, diff, {}, budget/2 );
+                }
+                codec.coder->commit( data );
+                patch.merged();
+                patch.apply( current );
+
+                std::vector<uint8_t> video = { 0x00, 0x00, 0x00, codec.signature };
+                video.insert( std::end(video), std::begin(data), std::end(data) );
+                try
+                {
+                    decoder.decode( video );
+                }
+                catch (const char *e)
+                {
+                    std::cerr << name << ": frame " << frames << " does not decode: " << e << "\n";
+                    return failures+1;
+                }
+                if (!(decoder.screen()==current))
+                    mismatches++;
+                frames++;
+            }
+        }
+
+        std::clog << name << " (pass " << pass+1 << "): " << frames << " frames, " << mismatches << " mismatches, " << over_budget << " over budget\n";
+        failures += mismatches+over_budget;
+    }
+
+    return failures;
+}
+
+int main()
+{
+    size_t failures = 0;
+
+    std::vector<codec> codecs = {
+        { "z32", 0x02, std::make_shared<vertical_compressor<uint32_t>>( W, H, uint32_ruler::ruler ) },
+        { "invert", 0x03, std::make_shared<invert_compressor>( W, H ) },
+        { "lines", 0x04, std::make_shared<copy_line_compressor>( W, H ) },
+        { "scroll", 0x05, std::make_shared<scroll_compressor>( W, H ) },
+        { "z32s", 0x06, std::make_shared<vertical_compressor<uint32_t>>( W, H, uint32_ruler::ruler, true ) },
+        { "tiles", 0x07, std::make_shared<tile_compressor>( W, H ) },
+        { "regions", 0x08, std::make_shared<region_compressor>( W, H ) },
+        { "mlines", 0x09, std::make_shared<multi_line_compressor>( W, H ) },
+        { "xor", 0x0a, std::make_shared<xor_compressor>( W, H ) },
+    };
+
+    for (auto &codec:codecs)
+        failures += check_codec( codec );
+
+    if (failures)
+    {
+        std::cerr << "FAILED\n";
+        return EXIT_FAILURE;
+    }
+
+    std::clog << "All codecs round-trip\n";
+    return EXIT_SUCCESS;
+}
@@ -1,7 +1,6 @@
 #ifndef RULER_INCLUDED__
 #define RULER_INCLUDED__
 
-#include <bitset>
 #include <iostream>
 #include <numeric>
 #include <cstdint>
@@ -21,83 +20,16 @@ class ruler
 
 class uint8_ruler : public ruler<uint8_t>
 {
-    size_t distance_[256][256];
-    bool known_[256][256];
-
-    bool set_distance( int n0, int n1, size_t v )
-    {
-        if (v>=distance_[n0][n1])
-            return false;
-
-        distance_[n0][n1] = distance_[n1][n0] = v;
-        known_[n0][n1] = known_[n1][n0] = true;
-
-        return true;
-    }
-
-    void set_distance( int n0, std::bitset<8> n1, size_t v ) { set_distance( n0, n1.to_ulong(), v ); }
-    void set_distance( std::bitset<8> n0, int n1, size_t v ) { set_distance( n1, n0, v ); }
-    void set_distance( std::bitset<8> n0, std::bitset<8> n1, size_t v ) { set_distance( n0.to_ulong(), n1.to_ulong(), v ); }
-
-    bool known( int x, int y ) { return known_[x][y]; }
-
-    void complete()
-    {
-        bool work_needed = true;
-
-        while (work_needed)
-        {
-            work_needed = false;
-            // std::clog << "Pass....\n";
-            for (int x=0;x!=256;x++)
-                for (int y=0;y!=256;y++)
-                {   for (int z=0;z!=256;z++)
-                        if (known(x,z) && known(y,z))
-                            work_needed |= set_distance( x, y, distance( x, z )+distance( z, y ) );
-                    work_needed |= !known( x,y );
-                }
-        } ;      
-    }
+        //  Swapping two adjacent different pixels costs 1, flipping a pixel costs 2
+        //  The table is generated at build time by mkruler (see Makefile)
+    static constexpr uint8_t distance_[256][256] =
+#include "ruler_table.hpp"
+    ;
 
 public:
-    uint8_ruler()
-    {
-        for (int x=0;x!=256;x++)
-            for (int y=0;y!=256;y++)
-            {
-                distance_[x][y] = std::numeric_limits<size_t>::max();
-                known_[x][y] = false;
-            }
-
-        for (int n=0;n!=256;n++)
-        {
-            set_distance( n, n, 0 );
-
-            std::bitset<8> bin(n);
+    static constexpr size_t byte_distance( uint8_t x, uint8_t y ) { return distance_[x][y]; }
 
-            for (int b=0;b!=8;b++)
-            {
-                set_distance( n, bin.flip(b), 2 );
-                bin.flip(b);
-            }
-        }
-
-        for (int n=0;n!=256;n++)
-            for (int b=0;b!=7;b++)
-            {
-                std::bitset<8> bin(n);
-                if (bin[b]!=bin[b+1])
-                {
-                    bin.flip(b);
-                    bin.flip(b+1);
-                    set_distance( n, bin, 1 );
-                }
-            }
-
-        complete();
-    }
-
-    virtual size_t distance( uint8_t x, uint8_t y ) const { return distance_[x][y]; }
+    virtual size_t distance( uint8_t x, uint8_t y ) const { return byte_distance( x, y ); }
 
     static const uint8_ruler ruler;
 };
@@ -136,12 +68,12 @@ public:
 template <typename T>
 class bit_ruler : public ruler<T>
 {
-    constexpr size_t get_T_bitcount() const
+    static constexpr size_t get_T_bitcount()
     {
         return sizeof(T)*8;
     }
 
-    constexpr size_t countbits( T v, size_t from, size_t to ) const
+    static constexpr size_t countbits( T v, size_t from, size_t to )
     {
         size_t res = 0;
         for (auto i=from;i!=to;i++)
@@ -149,7 +81,7 @@ class bit_ruler : public ruler<T>
         return res;
     }
 
-    constexpr size_t distance( T v0, T v1, size_t width ) const
+    static constexpr size_t distance( T v0, T v1, size_t width )
     {
         size_t res = 0;
         for (size_t i=0;i!=get_T_bitcount();i+=width)
@@ -162,13 +94,15 @@ class bit_ruler : public ruler<T>
     }
 
 public:
-    virtual size_t distance( T v0, T v1 ) const
+    static constexpr size_t bit_distance( T v0, T v1 )
     {
         size_t v = mypopcount( (T)(v0^v1) );         //  beware uint16_t ^ uint16_t is an int
         for (size_t i=1;i!=get_T_bitcount();i*=2)
             v += distance( v0, v1, i*2 );
         return v;
     }
+
+    virtual size_t distance( T v0, T v1 ) const { return bit_distance( v0, v1 ); }
 };
 
 #endif
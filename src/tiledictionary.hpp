@@ -0,0 +1,101 @@
+#ifndef TILEDICTIONARY_INCLUDED__
+#define TILEDICTIONARY_INCLUDED__
+
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "framebuffer.hpp"
+
+/**
+ * The last tiles sent by the tiles codec (0x07)
+ * The player keeps the very same dictionary, so a tile that comes back on screen
+ * can be sent as a one byte reference instead of its 32 bytes
+ * Tiles are 32x8 pixels, aligned on the 32 pixels words and on every 8th line
+ */
+class tile_dictionary
+{
+public:
+    static const size_t Size = 254;         //  Number of slots (slot numbers are one byte, 0xfe and 0xff are commands)
+    static const size_t TileHeight = 8;     //  Lines of a tile (one 32 pixels word each)
+
+    using tile = std::array<uint32_t,TileHeight>;
+
+private:
+    std::vector<tile> slots_;
+    size_t next_ = 0;                       //  Slot of the next insertion (the oldest one)
+    size_t used_ = 0;                       //  Number of slots that have been filled
+    std::unordered_map<uint64_t,size_t> index_;     //  Hash of a tile to its most recent slot
+
+    static uint64_t hash( const tile &t )
+    {
+        uint64_t h = 0xcbf29ce484222325;
+        for (auto v:t)
+            h = (h^v)*0x100000001b3;
+        return h;
+    }
+
+public:
+    tile_dictionary() : slots_( Size ) {}
+
+    void reset()
+    {
+        next_ = 0;
+        used_ = 0;
+        index_.clear();
+    }
+
+        //  Tile at column x (in 32 pixels words), starting at line y
+    static tile tile_at( const framebuffer &fb, size_t x, size_t y )
+    {
+        tile t;
+        for (size_t i=0;i!=TileHeight;i++)
+            t[i] = fb.value<uint32_t>( x, y+i );
+        return t;
+    }
+
+    const tile &at( size_t slot ) const { return slots_[slot]; }
+
+        //  Slot holding t, or -1
+    int find( const tile &t ) const
+    {
+        auto it = index_.find( hash( t ) );
+        if (it==std::end(index_) || slots_[it->second]!=t)
+            return -1;
+        return it->second;
+    }
+
+        //  0 for the last inserted tile, Size-1 for the next to be replaced
+    size_t age( size_t slot ) const { return (next_+Size-1-slot)%Size; }
+
+        //  Adds t in place of the oldest tile
+    void insert( const tile &t )
+    {
+        if (used_==Size)
+        {
+            auto it = index_.find( hash( slots_[next_] ) );
+            if (it!=std::end(index_) && it->second==next_)
+                index_.erase( it );
+        }
+        else
+            used_++;
+
+        slots_[next_] = t;
+        index_[hash( t )] = next_;
+        next_ = (next_+1)%Size;
+    }
+
+        //  A referenced tile that is about to be replaced is inserted again, so the tiles in use stay in the dictionary
+        //  (the player does exactly the same)
+    void use( size_t slot )
+    {
+        if (age( slot )>=Size/2)
+        {
+            tile t = slots_[slot];
+            insert( t );
+        }
+    }
+};
+
+#endif
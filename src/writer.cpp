@@ -42,7 +42,8 @@ class ffmpeg_writer : public output_writer {
     size_t audio_pos = 0;
     int audio_frame_counter = 0;
 
-    void pushFrame(const image &img, const sound_frame_t &snd) {
+    // Allocates the video frame on first use, returns false if it cannot
+    bool allocFrame() {
         int err;
         if (!videoFrame) {
             videoFrame = av_frame_alloc();
@@ -54,13 +55,20 @@ class ffmpeg_writer : public output_writer {
             videoFrame->height = video_context->height;
             if ((err = av_frame_get_buffer(videoFrame, 32)) < 0) {
                 std::cout << "Failed to allocate picture buffer: " << err << std::endl;
-                return;
+                av_frame_free(&videoFrame);
+                return false;
             }
             av_frame_make_writable(videoFrame);
 
             memset(videoFrame->data[1], 128, H_/2 * videoFrame->linesize[1]);
             memset(videoFrame->data[2], 128, H_/2 * videoFrame->linesize[2]);
         }
+        return true;
+    }
+
+    void pushFrame(const image &img, const sound_frame_t &snd) {
+        if (!allocFrame())
+            return;
 
         uint8_t *p = videoFrame->data[0];
         for (size_t y = 0; y != H_; y++) {
@@ -70,6 +78,32 @@ class ffmpeg_writer : public output_writer {
             }
         }
 
+        encodeFrame(snd);
+    }
+
+    // Each byte of the screen gives 8 luma bytes, without going through a float image
+    void pushFrame(const framebuffer &fb, const sound_frame_t &snd) {
+        if (!allocFrame())
+            return;
+
+        for (size_t y = 0; y != H_; y++) {
+            uint8_t *p = videoFrame->data[0] + y * videoFrame->linesize[0];
+            const uint8_t *s = fb.line(y);
+            for (size_t x = 0; x != W_ / 8; x++) {
+                uint8_t b = *s++;
+                for (int i = 0; i != 8; i++) {
+                    *p++ = (b & 0x80) ? 0 : 255;
+                    b <<= 1;
+                }
+            }
+        }
+
+        encodeFrame(snd);
+    }
+
+    void encodeFrame(const sound_frame_t &snd) {
+        int err;
+
         videoFrame->pts = 1500 * frameCounter;
 
         if ((err = avcodec_send_frame(video_context, videoFrame)) < 0) {
@@ -316,6 +350,10 @@ public:
     virtual void write_frame(const image& img, const sound_frame_t &snd) {
         pushFrame(img, snd);
     }
+
+    virtual void write_screen(const framebuffer& fb, const sound_frame_t &snd) {
+        pushFrame(fb, snd);
+    }
 };
 
 class gif_writer : public output_writer {
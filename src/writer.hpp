@@ -2,6 +2,7 @@
 #define WRITER_INCLUDED__
 
 #include "image.hpp"
+#include "framebuffer.hpp"
 
 #include <cstdint>
 #include <memory>
@@ -16,6 +17,9 @@ public:
     virtual ~output_writer() {}
 
     virtual void write_frame( const image& img, const sound_frame_t &snd ) = 0;
+
+        //  A decoded 1 bit screen (set bits are black)
+    virtual void write_screen( const framebuffer& fb, const sound_frame_t &snd ) { write_frame( fb.as_image(), snd ); }
 };
 
 std::unique_ptr<output_writer> make_ffmpeg_writer( const std::string &movie_path, size_t w, size_t h );